@@ -0,0 +1,342 @@
+#!/usr/bin/env lua
+
+-- Micro benchmarks for lua-zip.
+--
+-- Usage: lua bench.lua build_dir [benchmark_name ...]
+--
+-- Every benchmark prints one or more TAP style "# name: seconds"
+-- comment lines so the output can be diffed between runs.
+
+-- Global symbols:
+local _0 = string.sub(debug.getinfo(1,'S').source, 2)
+local zip
+local tmp_dir
+
+function load_libs(build_dir)
+    -- Set-up cpath and path properly:
+    build_dir = build_dir:gsub("(.*)/*", "%1")
+    local f=io.open(build_dir .. "/brimworks/zip.so", "r")
+    if ( f ) then
+        f:close()
+        package.cpath = build_dir .. "/?.so;" .. package.cpath
+        package.path  = build_dir .. "/?.lua;" .. package.path
+    end
+
+    package.path = _0:gsub("(.*/)(.*)", "%1?.lua;") .. package.path
+
+    -- Load libraries:
+    zip = require("brimworks.zip")
+
+    -- Export some globals:
+    tmp_dir = build_dir .. "/bench-tmp/"
+    os.execute("mkdir -p " .. tmp_dir)
+end
+
+local build_dir = ...
+load_libs(build_dir or "build")
+
+local function timeit(name, fn, ...)
+    collectgarbage("collect")
+    local start = os.clock()
+    fn(...)
+    local elapsed = os.clock() - start
+    print(string.format("# %-40s %10.4f s", name, elapsed))
+    return elapsed
+end
+
+local has_ffi, ffi = pcall(require, "ffi")
+if ( has_ffi ) then
+    ffi.cdef[[
+    typedef struct bench_timespec { long tv_sec; long tv_nsec; } bench_timespec;
+    int clock_gettime(int clk_id, bench_timespec* tp);
+    int open(const char* path, int flags, ...);
+    int close(int fd);
+    int posix_fadvise(int fd, int64_t offset, int64_t len, int advice);
+    ]]
+end
+
+-- Wall clock seconds, for benchmarks that block on I/O (os.clock()
+-- only counts CPU time).
+local now
+if ( has_ffi and ffi.os == "Linux" ) then
+    local ts = ffi.new("bench_timespec")
+    now = function()
+        ffi.C.clock_gettime(1 --[[ CLOCK_MONOTONIC ]], ts)
+        return tonumber(ts.tv_sec) + tonumber(ts.tv_nsec) * 1e-9
+    end
+else
+    now = function()
+        local p = io.popen("date +%s.%N")
+        local t = tonumber(p and p:read("*l") or "")
+        if ( p ) then p:close() end
+        return t or os.time()
+    end
+end
+
+local function walltime(name, fn, ...)
+    collectgarbage("collect")
+    local start = now()
+    fn(...)
+    local elapsed = now() - start
+    print(string.format("# %-40s %10.4f s (wall)", name, elapsed))
+    return elapsed
+end
+
+-- Evict path from the page cache so the next read has to hit the
+-- disk.  Returns false if that is not possible here.
+local function drop_cache(path)
+    os.execute("sync")
+    if ( has_ffi and ffi.os == "Linux" ) then
+        local fd = ffi.C.open(path, 0 --[[ O_RDONLY ]])
+        if ( fd >= 0 ) then
+            local err = ffi.C.posix_fadvise(fd, 0, 0, 4 --[[ POSIX_FADV_DONTNEED ]])
+            ffi.C.close(fd)
+            return err == 0
+        end
+        return false
+    end
+    -- GNU dd implements iflag=nocache with POSIX_FADV_DONTNEED:
+    local rc = os.execute("dd if=" .. path .. " iflag=nocache count=0 2>/dev/null")
+    return rc == true or rc == 0
+end
+
+-- Create an archive at path containing count entries of size bytes
+-- each.
+local function make_archive(path, count, size)
+    os.remove(path)
+    local ar = assert(zip.open(path, zip.OR(zip.CREATE, zip.EXCL)))
+    local data = string.rep("x", size)
+    for i=1, count do
+        ar:add("entry" .. i, "string", data)
+    end
+    ar:close()
+end
+
+local benchmarks = {}
+local order = {}
+
+-- Benchmarks registered with explicit=true are slow or need a lot of
+-- disk, so they only run when named on the command line.
+local function benchmark(name, fn, explicit)
+    benchmarks[name] = fn
+    if ( not explicit ) then order[#order+1] = name end
+end
+
+benchmark("read_ffi", function()
+    local zip_ffi = require("brimworks.zip_ffi")
+    local path    = tmp_dir .. "bench_read.zip"
+    local chunk   = 64 * 1024
+    local rounds  = 20
+
+    make_archive(path, 4, 16 * 1024 * 1024)
+
+    local ar = assert(zip.open(path))
+
+    timeit("read_ffi: file:read()", function()
+        for _=1, rounds do
+            for idx=1, #ar do
+                local file = assert(ar:open(idx))
+                while ( #assert(file:read(chunk)) > 0 ) do end
+                file:close()
+            end
+        end
+    end)
+
+    if ( not zip_ffi.available ) then
+        print("# read_ffi: skipping FFI path, requires LuaJIT")
+        ar:close()
+        return
+    end
+
+    local buf = zip_ffi.buffer(chunk)
+    timeit("read_ffi: zip_ffi.read()", function()
+        for _=1, rounds do
+            for idx=1, #ar do
+                local file = assert(ar:open(idx))
+                while ( assert(zip_ffi.read(file, buf)) > 0 ) do end
+                zip_ffi.close(file)
+            end
+        end
+    end)
+
+    timeit("read_ffi: zip_ffi.read_all()", function()
+        for _=1, rounds do
+            for idx=1, #ar do
+                assert(zip_ffi.read_all(ar, idx))
+            end
+        end
+    end)
+
+    ar:close()
+end)
+
+benchmark("pipe", function()
+    local path   = tmp_dir .. "bench_pipe.zip"
+    local chunk  = 4 * 1024
+    local rounds = 20
+
+    make_archive(path, 4, 16 * 1024 * 1024)
+
+    local ar    = assert(zip.open(path))
+    local bytes = 0
+    local function sink(chunk) bytes = bytes + #chunk end
+
+    timeit("pipe: file:read() loop", function()
+        for _=1, rounds do
+            for idx=1, #ar do
+                local file = assert(ar:open(idx))
+                while true do
+                    local str = assert(file:read(chunk))
+                    if ( #str == 0 ) then break end
+                    sink(str)
+                end
+                file:close()
+            end
+        end
+    end)
+
+    timeit("pipe: ar:pipe() strings", function()
+        for _=1, rounds do
+            for idx=1, #ar do
+                ar:pipe(idx, sink, chunk)
+            end
+        end
+    end)
+
+    timeit("pipe: ar:pipe() buffer", function()
+        local opts = { chunk_size = chunk, buffer = true }
+        for _=1, rounds do
+            for idx=1, #ar do
+                ar:pipe(idx, sink, opts)
+            end
+        end
+    end)
+
+    ar:close()
+end)
+
+-- Timed by wall clock, since the point is time spent waiting on the
+-- disk.  The cold runs evict the archive from the page cache first.
+benchmark("read_batch", function()
+    local path   = tmp_dir .. "bench_read_batch.zip"
+    local count  = 2000
+
+    make_archive(path, count, 64 * 1024)
+
+    -- A random order, like reading in name order from an archive
+    -- that was built in some other order:
+    local list = {}
+    for i=1, count do list[i] = "entry" .. i end
+    math.randomseed(1)
+    for i=count, 2, -1 do
+        local j = math.random(i)
+        list[i], list[j] = list[j], list[i]
+    end
+
+    local ar = assert(zip.open(path))
+
+    local function read_list()
+        for _, name in ipairs(list) do
+            local file = assert(ar:open(name))
+            assert(file:read(64 * 1024))
+            file:close()
+        end
+    end
+    local function read_batch()
+        assert(ar:read_batch(list))
+    end
+
+    for _, cache in ipairs({ "warm", "cold" }) do
+        if ( cache == "cold" and not drop_cache(path) ) then
+            print("# read_batch: skipping cold cache, can not drop the page cache")
+            break
+        end
+        walltime("read_batch: " .. cache .. " ar:open() in list order", read_list)
+        if ( cache == "cold" ) then drop_cache(path) end
+        walltime("read_batch: " .. cache .. " ar:read_batch()", read_batch)
+    end
+
+    ar:close()
+end)
+
+benchmark("add_many", function()
+    local path = tmp_dir .. "bench_add_many.zip"
+
+    for _, count in ipairs({ 62500, 125000, 250000, 500000 }) do
+        local entries = {}
+        for i=1, count do
+            entries[i] = { "e/" .. i, "string", "data" .. i }
+        end
+
+        os.remove(path)
+        local ar = assert(zip.open(path, zip.OR(zip.CREATE, zip.EXCL)))
+        timeit("add_many: ar:add() x " .. count, function()
+            for _, entry in ipairs(entries) do
+                ar:add(entry[1], entry[2], entry[3])
+            end
+            collectgarbage("collect")
+        end)
+        ar = nil
+        collectgarbage("collect")
+
+        ar = assert(zip.open(path, zip.OR(zip.CREATE, zip.EXCL)))
+        timeit("add_many: ar:add_many() x " .. count, function()
+            ar:add_many(entries)
+            collectgarbage("collect")
+        end)
+        ar = nil
+        collectgarbage("collect")
+    end
+end)
+
+benchmark("zip64", function()
+    local GB          = 1024 * 1024 * 1024
+    local path        = tmp_dir .. "bench_zip64.zip"
+    local sparse_file = tmp_dir .. "bench_zip64.bin"
+    local num_entries = 1000000
+
+    local f = assert(io.open(sparse_file, "wb"))
+    assert(f:seek("set", 6*GB - 1))
+    assert(f:write("x"))
+    f:close()
+
+    os.remove(path)
+    local ar = assert(zip.open(path, zip.OR(zip.CREATE, zip.EXCL)))
+    timeit("zip64: add 1M entries", function()
+        for i=1, num_entries do
+            ar:add("e/" .. i, "string", "")
+        end
+    end)
+    ar:add("big.bin", "file", sparse_file, 1*GB)
+    timeit("zip64: close 1M entries + 5 GB member", function()
+        ar:close()
+    end)
+
+    ar = assert(zip.open(path))
+    timeit("zip64: stat 1M entries", function()
+        for i=1, #ar do
+            assert(ar:stat(i))
+        end
+    end)
+    local bytes = 0
+    timeit("zip64: pipe 5 GB member", function()
+        bytes = ar:pipe("big.bin", function() end, 1024 * 1024)
+    end)
+    assert(bytes == 5*GB)
+    ar:close()
+
+    os.remove(sparse_file)
+    os.remove(path)
+end, true)
+
+local selected = { select(2, ...) }
+if ( #selected == 0 ) then selected = order end
+
+for _, name in ipairs(selected) do
+    local fn = benchmarks[name]
+    if ( not fn ) then
+        io.stderr:write("Unknown benchmark: " .. name .. "\n")
+        os.exit(1)
+    end
+    fn()
+end
@@ -1,14 +1,56 @@
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <lauxlib.h>
 #include <lua.h>
 #include <zip.h>
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* sync_dir() walks directories with the POSIX API, and read_batch()
+ * asks the kernel to read ahead with posix_fadvise() where available.
+ * Elsewhere sync_dir() raises an error and read_batch() reads without
+ * readahead hints.
+ */
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_SYNC_DIR 1
+#endif
+
+#ifdef POSIX_FADV_WILLNEED
+#define HAVE_READAHEAD 1
+#endif
+
+#ifdef _MSC_VER
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
 
 #if LUA_VERSION_NUM > 502 && !defined(LUA_COMPAT_APIINTCASTS)
 #define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
 #endif
 
+/* Sizes, offsets and indices are 64 bit.  Lua 5.3+ integers hold
+ * them exactly, older versions may have a 32 bit lua_Integer so use
+ * lua_Number (exact up to 2^53) instead.
+ */
+#if LUA_VERSION_NUM > 502
+#define check_int64(L,n)        ((zip_int64_t)luaL_checkinteger(L, (n)))
+#define push_int64(L,n)         lua_pushinteger(L, (lua_Integer)(n))
+#else
+#define check_int64(L,n)        ((zip_int64_t)luaL_checknumber(L, (n)))
+#define push_int64(L,n)         lua_pushnumber(L, (lua_Number)(n))
+#endif
+
 #if LUA_VERSION_NUM > 501
 #if !defined(LUA_COMPAT_MODULE)
 #define luaL_register(L,_,funcs) luaL_setfuncs((L),funcs,0)
@@ -22,10 +64,39 @@
 #define ARCHIVE_MT      "zip{archive}"
 #define ARCHIVE_FILE_MT "zip{archive.file}"
 #define WEAK_MT         "zip{weak}"
+#define BUFFER_MT       "zip{buffer}"
+#define DIR_MT          "zip{dir}"
+#define FD_MT           "zip{fd}"
+
+/* Default chunk size used by ar:pipe() */
+#define PIPE_CHUNK_SIZE 65536
+
+/* Default number of bytes ar:read_batch() asks the kernel to read
+ * ahead of the entry being read.
+ */
+#define READ_BATCH_READAHEAD (16*1024*1024)
+
+/* Progress and cancel callbacks for ar:close() need libzip 1.6 */
+#if defined(LIBZIP_VERSION_MAJOR) && \
+    (LIBZIP_VERSION_MAJOR > 1 || LIBZIP_VERSION_MINOR >= 6)
+#define HAVE_CLOSE_CALLBACKS 1
+#endif
 
 #define check_archive_file(L, narg)                                   \
     ((struct zip_file**)luaL_checkudata((L), (narg), ARCHIVE_FILE_MT))
 
+#define check_buffer(L, narg)                                         \
+    ((struct S_buffer*)luaL_checkudata((L), (narg), BUFFER_MT))
+
+/* A reusable chunk of native memory handed to ar:pipe() sinks, len
+ * is the number of valid bytes in data.
+ */
+struct S_buffer {
+    size_t len;
+    size_t size;
+    char   data[1];
+};
+
 #define absindex(L,i) ((i)>0?(i):lua_gettop(L)+(i)+1)
 
 static int S_archive_gc(lua_State* L);
@@ -92,6 +163,7 @@ static int S_archive_open(lua_State* L) {
     int          flags = (lua_gettop(L) < 2) ? 0 : luaL_checkint(L, 2);
     struct zip** ar    = (struct zip**)lua_newuserdata(L, sizeof(struct zip*));
     int          err   = 0;
+    char*        real_path;
 
     *ar = zip_open(path, flags, &err);
 
@@ -124,6 +196,21 @@ static int S_archive_open(lua_State* L) {
     lua_setmetatable(L, -2);
     lua_setfield(L, -2, "refs");
 
+    /* Remember the absolute path for read_batch(), which reads the
+     * central directory itself.  A new archive has no central
+     * directory yet, so there is nothing to remember.
+     */
+#ifdef _WIN32
+    real_path = _fullpath(NULL, path, 0);
+#else
+    real_path = realpath(path, NULL);
+#endif
+    if ( NULL != real_path ) {
+        lua_pushstring(L, real_path);
+        free(real_path);
+        lua_setfield(L, -2, "path");
+    }
+
     lua_setmetatable(L, -2);
 
     return 1;
@@ -139,6 +226,16 @@ static void S_get_refs(lua_State* L, int ar_idx) {
     lua_remove(L, -2);
 }
 
+/* Push the absolute path of the archive at index ar_idx, or nil if
+ * it did not exist when opened.
+ */
+static void S_get_path(lua_State* L, int ar_idx) {
+    int ok = lua_getmetatable(L, ar_idx);
+    assert(ok /* ar_idx has metatable */);
+    lua_getfield(L, -1, "path");
+    lua_remove(L, -2);
+}
+
 /* Invalidate all "weak" references.  This should be done just before
  * zip_close() is called.  Invalidation occurs by calling __gc
  * metamethod.
@@ -192,22 +289,194 @@ static void S_archive_add_ref(lua_State* L, int is_weak, int ar_idx, int obj_idx
     lua_pop(L, 1); /* Pop the refs */
 }
 
+#ifdef HAVE_CLOSE_CALLBACKS
+/* State for the ar:close() progress and cancel callbacks.  Lua
+ * values live on the stack of the close call: progress_idx and
+ * cancel_idx are the callbacks (0 if not given), and error_idx holds
+ * the first error raised by either callback.
+ */
+struct S_close_state {
+    lua_State*    L;
+    int           progress_idx;
+    int           cancel_idx;
+    int           error_idx;
+    int           failed;
+    double        start;
+    double        fraction;
+    zip_uint64_t  num;
+    zip_uint64_t* offsets;
+};
+
+static double S_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    /* The Windows C runtime's clock() measures wall clock time. */
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* libzip reports progress as a fraction where each surviving entry
+ * gets an equal share, so use the running total of entry sizes
+ * (offsets) to estimate how many bytes have been processed.
+ */
+static zip_uint64_t S_close_bytes(struct S_close_state* state) {
+    double       pos;
+    zip_uint64_t entry;
+
+    if ( 0 == state->num ) return 0;
+
+    pos   = state->fraction * state->num;
+    entry = (zip_uint64_t)pos;
+    if ( entry >= state->num ) return state->offsets[state->num];
+
+    return state->offsets[entry] + (zip_uint64_t)
+        ((pos - entry) * (state->offsets[entry+1] - state->offsets[entry]));
+}
+
+/* Call the Lua function at fn_idx with (fraction, bytes, elapsed) and
+ * return true if it returned a true value.  Errors are recorded so
+ * the close can be cancelled and the error raised afterwards.
+ */
+static int S_close_call(struct S_close_state* state, int fn_idx) {
+    lua_State* L = state->L;
+    int        result;
+
+    if ( state->failed ) return 0;
+
+    lua_pushvalue(L, fn_idx);
+    lua_pushnumber(L, state->fraction);
+    push_int64(L, S_close_bytes(state));
+    lua_pushnumber(L, S_now() - state->start);
+    if ( 0 != lua_pcall(L, 3, 1, 0) ) {
+        lua_replace(L, state->error_idx);
+        state->failed = 1;
+        return 0;
+    }
+    result = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    return result;
+}
+
+static void S_close_progress(struct zip* ar, double fraction, void* ud) {
+    struct S_close_state* state = (struct S_close_state*)ud;
+
+    state->fraction = fraction;
+    if ( state->progress_idx ) S_close_call(state, state->progress_idx);
+}
+
+static int S_close_cancel(struct zip* ar, void* ud) {
+    struct S_close_state* state = (struct S_close_state*)ud;
+
+    if ( state->cancel_idx && S_close_call(state, state->cancel_idx) ) return 1;
+
+    return state->failed;
+}
+
+/* Register the callbacks from the options table at index 2.
+ */
+static void S_close_register(lua_State* L, struct zip* ar, struct S_close_state* state) {
+    double       interval;
+    zip_int64_t  num = zip_get_num_entries(ar, 0);
+    zip_int64_t  idx;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    memset(state, 0, sizeof(*state));
+    state->L = L;
+
+    lua_getfield(L, 2, "progress");
+    if ( ! lua_isnil(L, -1) ) {
+        luaL_checktype(L, -1, LUA_TFUNCTION);
+        state->progress_idx = lua_gettop(L);
+    }
+    lua_getfield(L, 2, "cancel");
+    if ( ! lua_isnil(L, -1) ) {
+        luaL_checktype(L, -1, LUA_TFUNCTION);
+        state->cancel_idx = lua_gettop(L);
+    }
+    lua_getfield(L, 2, "interval");
+    interval = lua_isnil(L, -1) ? 0.01 : luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushnil(L);
+    state->error_idx = lua_gettop(L);
+
+    /* Running total of the sizes of the entries that will be written.
+     */
+    state->offsets = (zip_uint64_t*)
+        lua_newuserdata(L, (num + 1) * sizeof(zip_uint64_t));
+    state->offsets[0] = 0;
+    for ( idx = 0; idx < num; idx++ ) {
+        struct zip_stat stat;
+
+        /* Deleted entries have no stat. */
+        if ( 0 != zip_stat_index(ar, idx, 0, &stat) ) continue;
+
+        state->offsets[state->num+1] = state->offsets[state->num] +
+            ((stat.valid & ZIP_STAT_SIZE) ? stat.size : 0);
+        state->num++;
+    }
+
+    luaL_checkstack(L, 8, "close");
+
+    state->start = S_now();
+    zip_register_progress_callback_with_state(ar, interval, &S_close_progress, NULL, state);
+    zip_register_cancel_callback_with_state(ar, &S_close_cancel, NULL, state);
+}
+#endif
+
 /* Explicitly close the archive, throwing an error if there are any
  * problems.
  */
 static int S_archive_close(lua_State* L) {
     struct zip*  ar  = *check_archive(L, 1);
     int          err;
+#ifdef HAVE_CLOSE_CALLBACKS
+    struct S_close_state state;
+
+    state.failed = 0;
+#endif
 
     if ( ! ar ) return 0;
 
+    if ( ! lua_isnoneornil(L, 2) ) {
+#ifdef HAVE_CLOSE_CALLBACKS
+        S_close_register(L, ar, &state);
+#else
+        luaL_argerror(L, 2, "close options require libzip 1.6 or later");
+#endif
+    }
+
     S_archive_gc_refs(L, 1);
 
     err = zip_close(ar);
     if ( err != 0 ) {
+#ifdef HAVE_CLOSE_CALLBACKS
+        if ( state.failed ) {
+            lua_pushvalue(L, state.error_idx);
+        } else
+#endif
         S_push_error(L, zip_error_code_zip(zip_get_error(ar)), errno);
+
+        /* The handle is already invalidated, so free it.  libzip has
+         * removed its temporary file and left the archive unchanged.
+         */
+        zip_discard(ar);
+        lua_error(L);
+    }
+
+#ifdef HAVE_CLOSE_CALLBACKS
+    /* A callback failed after the last chance to cancel. */
+    if ( state.failed ) {
+        lua_pushvalue(L, state.error_idx);
         lua_error(L);
     }
+#endif
 
     return 0;
 }
@@ -233,7 +502,7 @@ static int S_archive_get_num_files(lua_State* L) {
 
     if ( ! *ar ) return 0;
 
-    lua_pushinteger(L, zip_get_num_files(*ar));
+    push_int64(L, zip_get_num_entries(*ar, 0));
 
     return 1;
 }
@@ -242,7 +511,7 @@ static int S_archive_name_locate(lua_State* L) {
     struct zip** ar    = check_archive(L, 1);
     const char*  fname = luaL_checkstring(L, 2);
     int          flags = (lua_gettop(L) < 3) ? 0 : luaL_checkint(L, 3);
-    int          idx;
+    zip_int64_t  idx;
 
     if ( ! *ar ) return 0;
 
@@ -254,14 +523,14 @@ static int S_archive_name_locate(lua_State* L) {
         return 2;
     }
 
-    lua_pushinteger(L, idx+1);
+    push_int64(L, idx+1);
     return 1;
 }
 
 static int S_archive_stat(lua_State* L) {
     struct zip**    ar        = check_archive(L, 1);
     const char*     path      = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
-    int             path_idx  = (lua_isnumber(L, 2)) ? luaL_checkint(L, 2)-1 : -1;
+    zip_int64_t     path_idx  = (lua_isnumber(L, 2)) ? check_int64(L, 2)-1 : -1;
     int             flags     = (lua_gettop(L) < 3)  ? 0    : luaL_checkint(L, 3);
     struct zip_stat stat;
     int             result;
@@ -285,25 +554,25 @@ static int S_archive_stat(lua_State* L) {
     lua_pushstring(L, stat.name);
     lua_setfield(L, -2, "name");
 
-    lua_pushinteger(L, stat.index+1);
+    push_int64(L, stat.index+1);
     lua_setfield(L, -2, "index");
 
-    lua_pushnumber(L, stat.crc);
+    push_int64(L, stat.crc);
     lua_setfield(L, -2, "crc");
 
-    lua_pushnumber(L, stat.size);
+    push_int64(L, stat.size);
     lua_setfield(L, -2, "size");
 
-    lua_pushnumber(L, stat.mtime);
+    push_int64(L, stat.mtime);
     lua_setfield(L, -2, "mtime");
 
-    lua_pushnumber(L, stat.comp_size);
+    push_int64(L, stat.comp_size);
     lua_setfield(L, -2, "comp_size");
 
-    lua_pushnumber(L, stat.comp_method);
+    lua_pushinteger(L, stat.comp_method);
     lua_setfield(L, -2, "comp_method");
 
-    lua_pushnumber(L, stat.encryption_method);
+    lua_pushinteger(L, stat.encryption_method);
     lua_setfield(L, -2, "encryption_method");
 
     return 1;
@@ -311,7 +580,7 @@ static int S_archive_stat(lua_State* L) {
 
 static int S_archive_get_external_attributes(lua_State* L) {
     struct zip** ar       = check_archive(L, 1);
-    int          path_idx = luaL_checkint(L, 2)-1;
+    zip_int64_t  path_idx = check_int64(L, 2)-1;
     int          flags    = (lua_gettop(L) < 3) ? 0 : luaL_checkint(L, 3);
 
     if ( ! *ar ) return 0;
@@ -332,7 +601,7 @@ static int S_archive_get_external_attributes(lua_State* L) {
 
 static int S_archive_get_name(lua_State* L) {
     struct zip** ar        = check_archive(L, 1);
-    int          path_idx  = luaL_checkint(L, 2)-1;
+    zip_int64_t  path_idx  = check_int64(L, 2)-1;
     int          flags     = (lua_gettop(L) < 3)  ? 0    : luaL_checkint(L, 3);
     const char*  name;
 
@@ -385,7 +654,7 @@ static int S_archive_set_archive_comment(lua_State* L) {
 
 static int S_archive_get_file_comment(lua_State* L) {
     struct zip** ar        = check_archive(L, 1);
-    int          path_idx  = luaL_checkint(L, 2)-1;
+    zip_int64_t  path_idx  = check_int64(L, 2)-1;
     int          flags     = (lua_gettop(L) < 3)  ? 0    : luaL_checkint(L, 3);
     const char*  comment;
     int          comment_len;
@@ -404,7 +673,7 @@ static int S_archive_get_file_comment(lua_State* L) {
 
 static int S_archive_set_file_comment(lua_State* L) {
     struct zip** ar          = check_archive(L, 1);
-    int          path_idx    = luaL_checkint(L, 2)-1;
+    zip_int64_t  path_idx    = check_int64(L, 2)-1;
     size_t       comment_len = 0;
     const char*  comment     = lua_isnil(L, 3) ? NULL : luaL_checklstring(L, 3, &comment_len);
 
@@ -421,7 +690,7 @@ static int S_archive_set_file_comment(lua_State* L) {
 static int S_archive_add_dir(lua_State* L) {
     struct zip**        ar   = check_archive(L, 1);
     const char*         path = luaL_checkstring(L, 2);
-    int                 idx;
+    zip_int64_t         idx;
 
     if ( ! *ar ) return 0;
 
@@ -434,7 +703,7 @@ static int S_archive_add_dir(lua_State* L) {
         return 0;
     }
 
-    lua_pushinteger(L, idx);
+    push_int64(L, idx);
 
     return 1;
 }
@@ -455,8 +724,8 @@ static struct zip_source* S_create_source_string(lua_State* L, struct zip* ar) {
 
 static struct zip_source* S_create_source_file(lua_State* L, struct zip* ar) {
     const char*        fname = luaL_checkstring(L, 4);
-    int                start = lua_gettop(L) < 5 ? 0  : luaL_checkint(L, 5);
-    int                len   = lua_gettop(L) < 6 ? -1 : luaL_checkint(L, 6);
+    zip_uint64_t       start = lua_gettop(L) < 5 ? 0  : check_int64(L, 5);
+    zip_int64_t        len   = lua_gettop(L) < 6 ? -1 : check_int64(L, 6);
     struct zip_source* src   = zip_source_file(ar, fname, start, len);
 
     if ( NULL != src ) return src;
@@ -468,10 +737,10 @@ static struct zip_source* S_create_source_file(lua_State* L, struct zip* ar) {
 
 static struct zip_source* S_create_source_zip(lua_State* L, struct zip* ar) {
     struct zip**       other_ar = check_archive(L, 4);
-    int                file_idx = luaL_checkint(L, 5);
+    zip_int64_t        file_idx = check_int64(L, 5);
     int                flags    = lua_gettop(L) < 6 ? 0  : luaL_checkint(L, 6);
-    int                start    = lua_gettop(L) < 7 ? 0  : luaL_checkint(L, 7);
-    int                len      = lua_gettop(L) < 8 ? -1 : luaL_checkint(L, 8);
+    zip_uint64_t       start    = lua_gettop(L) < 7 ? 0  : check_int64(L, 7);
+    zip_int64_t        len      = lua_gettop(L) < 8 ? -1 : check_int64(L, 8);
     struct zip_source* src      = NULL;
 
     if ( ! *other_ar ) return NULL;
@@ -523,14 +792,13 @@ static struct zip_source* S_create_source(lua_State* L, struct zip* ar) {
 
 static int S_archive_replace(lua_State* L) {
     struct zip**        ar   = check_archive(L, 1);
-    int                 idx  = luaL_checkinteger(L, 2);
+    zip_int64_t         idx  = check_int64(L, 2);
     struct zip_source*  src  = S_create_source(L, *ar);
 
     if ( ! *ar ) return 0;
 
-    idx = zip_replace(*ar, idx-1, src) + 1;
-
-    if ( 0 == idx ) {
+    /* zip_replace() returns 0 on success, not the index */
+    if ( 0 != zip_replace(*ar, idx-1, src) ) {
         zip_source_free(src);
         lua_pushstring(L, zip_strerror(*ar));
         lua_error(L);
@@ -538,7 +806,7 @@ static int S_archive_replace(lua_State* L) {
 
     S_archive_add_ref(L, 0, 1, 4);
 
-    lua_pushinteger(L, idx);
+    push_int64(L, idx);
 
     return 1;
 }
@@ -546,7 +814,7 @@ static int S_archive_replace(lua_State* L) {
 static int S_archive_rename(lua_State* L) {
     struct zip**        ar        = check_archive(L, 1);
     const char*         path      = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
-    int                 path_idx  = (lua_isnumber(L, 2)) ? luaL_checkint(L, 2)-1 : -1;
+    zip_int64_t         path_idx  = (lua_isnumber(L, 2)) ? check_int64(L, 2)-1 : -1;
     const char*         new_path  = luaL_checkstring(L, 3);
 
     if ( ! *ar ) return 0;
@@ -568,7 +836,7 @@ static int S_archive_rename(lua_State* L) {
 static int S_archive_delete(lua_State* L) {
     struct zip**        ar        = check_archive(L, 1);
     const char*         path      = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
-    int                 path_idx  = (lua_isnumber(L, 2)) ? luaL_checkint(L, 2)-1 : -1;
+    zip_int64_t         path_idx  = (lua_isnumber(L, 2)) ? check_int64(L, 2)-1 : -1;
 
     if ( ! *ar ) return 0;
 
@@ -590,7 +858,7 @@ static int S_archive_add(lua_State* L) {
     struct zip**        ar   = check_archive(L, 1);
     const char*         path = luaL_checkstring(L, 2);
     struct zip_source*  src  = S_create_source(L, *ar);
-    int                 idx;
+    zip_int64_t         idx;
 
     if ( ! *ar ) return 0;
 
@@ -604,33 +872,504 @@ static int S_archive_add(lua_State* L) {
 
     S_archive_add_ref(L, 0, 1, 4);
 
-    lua_pushinteger(L, idx);
+    push_int64(L, idx);
 
     return 1;
 }
 
-static int S_archive_file_open(lua_State* L) {
-    struct zip** ar        = check_archive(L, 1);
-    const char*  path      = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
-    int          path_idx  = (lua_isnumber(L, 2)) ? luaL_checkint(L, 2)-1 : -1;
-    int          flags     = (lua_gettop(L) < 3)  ? 0    : luaL_checkint(L, 3);
-    struct zip_file** file = (struct zip_file**)
-        lua_newuserdata(L, sizeof(struct zip_file*));
+/* Convert the number at idx to a 64 bit integer the same way as
+ * check_int64().  Returns false if it is not a number.
+ */
+static int S_to_int64(lua_State* L, int idx, zip_int64_t* out) {
+#if LUA_VERSION_NUM > 502
+    int isnum;
+    *out = (zip_int64_t)lua_tointegerx(L, idx, &isnum);
+    return isnum;
+#else
+    if ( ! lua_isnumber(L, idx) ) return 0;
+    *out = (zip_int64_t)lua_tonumber(L, idx);
+    return 1;
+#endif
+}
 
-    *file = NULL;
+/* Check the add_many() entry at index -1 so no entry is added unless
+ * all of them are well formed.  Throws "entry N: ..." errors.
+ */
+static void S_check_entry(lua_State* L, lua_Integer pos) {
+    const char* type;
+    zip_int64_t val;
+
+    if ( ! lua_istable(L, -1) ) {
+        luaL_error(L, "entry %d: table expected", (int)pos);
+    }
+
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_rawgeti(L, -3, 3);
+    if ( lua_type(L, -3) != LUA_TSTRING ) {
+        luaL_error(L, "entry %d: filename expected", (int)pos);
+    }
+    type = lua_tostring(L, -2);
+    if ( NULL == type || ! lua_isstring(L, -1) ) {
+        luaL_error(L, "entry %d: { filename, type, ... } expected", (int)pos);
+    }
+
+    if ( 0 == strcmp(type, "file") ) {
+        lua_rawgeti(L, -4, 4);
+        lua_rawgeti(L, -5, 5);
+        if ( ! lua_isnil(L, -2) && ( ! S_to_int64(L, -2, &val) || val < 0 ) ) {
+            luaL_error(L, "entry %d: start must be a non-negative integer", (int)pos);
+        }
+        if ( ! lua_isnil(L, -1) && ( ! S_to_int64(L, -1, &val) || val < -1 ) ) {
+            luaL_error(L, "entry %d: len must be an integer (-1 for the rest of the file)", (int)pos);
+        }
+        lua_pop(L, 2);
+    } else if ( 0 != strcmp(type, "string") ) {
+        luaL_error(L, "entry %d: invalid source type '%s' (use add() for \"zip\")", (int)pos, type);
+    }
+
+    lua_pop(L, 3);
+}
+
+/* Create a source for one add_many() entry, the table at index -1,
+ * which S_check_entry() accepted.  String data is copied and owned
+ * by the source (libzip frees it with the source), so unlike add()
+ * nothing needs to be recorded in the refs table.  Returns NULL and
+ * pushes an error message on failure.
+ */
+static struct zip_source* S_create_source_entry(lua_State* L, struct zip* ar) {
+    struct zip_source* src = NULL;
+    const char*        type;
+    const char*        data;
+    size_t             len;
+
+    lua_rawgeti(L, -1, 2);
+    lua_rawgeti(L, -2, 3);
+    type = lua_tostring(L, -2);
+    data = lua_tolstring(L, -1, &len);
+
+    if ( 0 == strcmp(type, "string") ) {
+        char* copy = (char*)malloc(len ? len : 1);
+        if ( NULL == copy ) {
+            lua_pop(L, 2);
+            lua_pushliteral(L, "Not enough memory");
+            return NULL;
+        }
+        memcpy(copy, data, len);
+        src = zip_source_buffer(ar, copy, len, 1);
+        if ( NULL == src ) free(copy);
+    } else {
+        zip_int64_t start = 0;
+        zip_int64_t flen  = -1;
+
+        lua_rawgeti(L, -3, 4);
+        lua_rawgeti(L, -4, 5);
+        if ( ! lua_isnil(L, -2) ) S_to_int64(L, -2, &start);
+        if ( ! lua_isnil(L, -1) ) S_to_int64(L, -1, &flen);
+        lua_pop(L, 2);
+
+        src = zip_source_file(ar, data, start, flen);
+    }
+
+    lua_pop(L, 2);
+
+    if ( NULL == src ) lua_pushstring(L, zip_strerror(ar));
+
+    return src;
+}
+
+/* Add many entries with a single call:
+ *
+ *     first_idx, last_idx = ar:add_many({ { filename, ...zip_source }, ... })
+ *
+ * Only "string" and "file" sources are supported.  Either every
+ * entry is added or none are.
+ */
+static int S_archive_add_many(lua_State* L) {
+    struct zip**       ar    = check_archive(L, 1);
+    zip_int64_t        first = 0;
+    zip_int64_t        idx   = 0;
+    lua_Integer        pos, num;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
 
     if ( ! *ar ) return 0;
 
+    num = lua_objlen(L, 2);
+    for ( pos = 1; pos <= num; pos++ ) {
+        lua_rawgeti(L, 2, pos);
+        S_check_entry(L, pos);
+        lua_pop(L, 1);
+    }
+
+    for ( pos = 1; pos <= num; pos++ ) {
+        struct zip_source* src;
+        const char*        path;
+
+        lua_rawgeti(L, 2, pos);
+        lua_rawgeti(L, -1, 1);
+        path = lua_tostring(L, -1);
+        lua_insert(L, -2);
+
+        /* The filename stays below the entry table until zip_add(). */
+        src = S_create_source_entry(L, *ar);
+        idx = NULL == src ? 0 : zip_add(*ar, path, src) + 1;
+        if ( 0 == idx ) {
+            if ( NULL != src ) {
+                zip_source_free(src);
+                lua_pushstring(L, zip_strerror(*ar));
+            }
+            luaL_where(L, 1);
+            lua_pushfstring(L, "entry %d: %s", (int)pos, lua_tostring(L, -2));
+            lua_concat(L, 2);
+
+            /* Undo the entries this call already added. */
+            for ( idx = first; first && idx < first + pos - 1; idx++ ) {
+                zip_delete(*ar, idx - 1);
+            }
+            return lua_error(L);
+        }
+        if ( 1 == pos ) first = idx;
+
+        lua_pop(L, 2);
+    }
+
+    if ( 0 == num ) return 0;
+
+    push_int64(L, first);
+    push_int64(L, idx);
+    return 2;
+}
+
+#ifdef HAVE_SYNC_DIR
+
+/* CRC-32 (as used by zip) of the file at path, used by sync_dir
+ * when asked to compare file contents.  Returns 0 on success.
+ */
+static int S_file_crc32(const char* path, zip_uint32_t* crc_out) {
+    static zip_uint32_t table[256];
+    char                buff[65536];
+    zip_uint32_t        crc = 0xFFFFFFFF;
+    size_t              len, i;
+    FILE*               fh;
+
+    if ( 0 == table[1] ) {
+        zip_uint32_t n, c, k;
+        for ( n = 0; n < 256; n++ ) {
+            c = n;
+            for ( k = 0; k < 8; k++ ) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+    }
+
+    fh = fopen(path, "rb");
+    if ( NULL == fh ) return -1;
+
+    while ( (len = fread(buff, 1, sizeof(buff), fh)) > 0 ) {
+        for ( i = 0; i < len; i++ ) {
+            crc = table[(crc ^ (zip_uint8_t)buff[i]) & 0xFF] ^ (crc >> 8);
+        }
+    }
+
+    if ( ferror(fh) ) {
+        fclose(fh);
+        return -1;
+    }
+    fclose(fh);
+
+    *crc_out = crc ^ 0xFFFFFFFF;
+    return 0;
+}
+
+/* State shared by the recursive sync_dir walk.  entries_idx is a
+ * table of archive entry name -> 1 based index for every entry under
+ * the prefix that has not been seen on disk (yet), and summary_idx
+ * is the table returned to the caller.
+ */
+struct S_sync {
+    struct zip* ar;
+    const char* prefix;
+    int         crc;
+    int         entries_idx;
+    int         summary_idx;
+    lua_Integer unchanged;
+};
+
+/* Append the value on top of the stack to summary[field] and pop it.
+ */
+static void S_sync_append(lua_State* L, struct S_sync* sync, const char* field) {
+    lua_getfield(L, sync->summary_idx, field);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, lua_objlen(L, -2)+1);
+    lua_pop(L, 1);
+}
+
+/* Returns true if the archive entry at idx has the same contents as
+ * the file at path according to size, mtime and (optionally) crc.
+ */
+static int S_sync_is_unchanged(struct S_sync* sync, zip_uint64_t idx, const char* path, struct stat* sb) {
+    struct zip_stat stat;
+    zip_uint32_t    crc;
+    time_t          diff;
+
+    if ( 0 != zip_stat_index(sync->ar, idx, 0, &stat) ) return 0;
+
+    if ( stat.size != (zip_uint64_t)sb->st_size ) return 0;
+
+    /* DOS timestamps have a two second resolution and are truncated.
+     */
+    diff = sb->st_mtime - stat.mtime;
+    if ( diff < 0 || diff > 1 ) return 0;
+
+    if ( ! sync->crc ) return 1;
+
+    return 0 == S_file_crc32(path, &crc) && crc == stat.crc;
+}
+
+/* Sync the regular file at path (index -2) to the entry name (index
+ * -1) and pop both.  Returns non-zero and pushes an error message on
+ * failure.
+ */
+static int S_sync_file(lua_State* L, struct S_sync* sync, struct stat* sb) {
+    const char*        path = lua_tostring(L, -2);
+    const char*        name = lua_tostring(L, -1);
+    struct zip_source* src;
+    zip_int64_t        idx  = -1;
+
+    lua_getfield(L, sync->entries_idx, name);
+    if ( ! lua_isnil(L, -1) ) {
+        idx = (zip_int64_t)lua_tonumber(L, -1) - 1;
+
+        /* Mark it as seen so it isn't deleted. */
+        lua_pushvalue(L, -2);
+        lua_pushboolean(L, 0);
+        lua_rawset(L, sync->entries_idx);
+    }
+    lua_pop(L, 1);
+
+    if ( idx >= 0 && S_sync_is_unchanged(sync, idx, path, sb) ) {
+        sync->unchanged++;
+        lua_pop(L, 2);
+        return 0;
+    }
+
+    src = zip_source_file(sync->ar, path, 0, -1);
+    if ( NULL == src ) {
+        lua_pushfstring(L, "%s '%s'", zip_strerror(sync->ar), path);
+        return -1;
+    }
+
+    if ( idx >= 0 ? 0 != zip_replace(sync->ar, idx, src)
+                  : zip_add(sync->ar, name, src) < 0 )
+    {
+        zip_source_free(src);
+        lua_pushfstring(L, "%s '%s'", zip_strerror(sync->ar), name);
+        return -1;
+    }
+
+    S_sync_append(L, sync, idx >= 0 ? "replaced" : "added");
+    lua_pop(L, 1); /* Pop the path */
+
+    return 0;
+}
+
+static int S_dir_gc(lua_State* L) {
+    DIR** dh = (DIR**)luaL_checkudata(L, 1, DIR_MT);
+
+    if ( ! *dh ) return 0;
+
+    closedir(*dh);
+    *dh = NULL;
+
+    return 0;
+}
+
+/* Recursively sync the directory at dir, whose entries are named
+ * prefix .. rel .. filename within the archive.  Returns non-zero
+ * and pushes an error message on failure.
+ *
+ * Symlinks to regular files are synced as the file they point to.
+ * Symlinks to directories (which may form cycles or leave root) and
+ * dangling symlinks are skipped.
+ */
+static int S_sync_dir_walk(lua_State* L, struct S_sync* sync, const char* dir, const char* rel) {
+    struct dirent* ent;
+    struct stat    sb;
+    int            err = 0;
+    DIR**          dh;
+
+    luaL_checkstack(L, 8, "sync_dir");
+
+    /* The handle lives in a userdata so it is closed even if a Lua
+     * error unwinds the walk.
+     */
+    dh  = (DIR**)lua_newuserdata(L, sizeof(DIR*));
+    *dh = NULL;
+    luaL_getmetatable(L, DIR_MT);
+    lua_setmetatable(L, -2);
+
+    *dh = opendir(dir);
+    if ( NULL == *dh ) {
+        lua_pop(L, 1);
+        lua_pushfstring(L, "%s '%s'", strerror(errno), dir);
+        return -1;
+    }
+
+    while ( 0 == err && NULL != (ent = readdir(*dh)) ) {
+        const char* path;
+
+        if ( 0 == strcmp(ent->d_name, ".") || 0 == strcmp(ent->d_name, "..") ) {
+            continue;
+        }
+
+        path = lua_pushfstring(L, "%s/%s", dir, ent->d_name);
+
+        if ( 0 != lstat(path, &sb) ) {
+            lua_pushfstring(L, "%s '%s'", strerror(errno), path);
+            err = -1;
+        } else if ( S_ISLNK(sb.st_mode) &&
+                    ( 0 != stat(path, &sb) || ! S_ISREG(sb.st_mode) ) )
+        {
+            lua_pop(L, 1);
+        } else if ( S_ISDIR(sb.st_mode) ) {
+            const char* sub_rel = lua_pushfstring(L, "%s%s/", rel, ent->d_name);
+            err = S_sync_dir_walk(L, sync, path, sub_rel);
+            if ( 0 == err ) lua_pop(L, 2);
+        } else if ( S_ISREG(sb.st_mode) ) {
+            lua_pushfstring(L, "%s%s%s", sync->prefix, rel, ent->d_name);
+            err = S_sync_file(L, sync, &sb);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+
+    closedir(*dh);
+    *dh = NULL;
+
+    /* On failure the error message is left on top. */
+    if ( 0 == err ) lua_pop(L, 1);
+
+    return err;
+}
+
+/* Make the entries under prefix match the directory tree at root:
+ *
+ *     summary = ar:sync_dir(root [, options])
+ *
+ * Unchanged entries are left alone so zip_close() copies their
+ * compressed data verbatim.
+ */
+static int S_archive_sync_dir(lua_State* L) {
+    struct zip**  ar   = check_archive(L, 1);
+    const char*   root = luaL_checkstring(L, 2);
+    struct S_sync sync;
+    zip_int64_t   num, idx;
+    size_t        prefix_len = 0;
+
+    sync.prefix    = "";
+    sync.crc       = 0;
+    sync.unchanged = 0;
+
+    if ( ! lua_isnoneornil(L, 3) ) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "prefix");
+        if ( ! lua_isnil(L, -1) ) sync.prefix = luaL_checklstring(L, -1, &prefix_len);
+        lua_getfield(L, 3, "crc");
+        sync.crc = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+
+    if ( ! *ar ) return 0;
+
+    sync.ar = *ar;
+
+    lua_newtable(L);
+    sync.entries_idx = lua_gettop(L);
+
+    num = zip_get_num_entries(sync.ar, 0);
+    for ( idx = 0; idx < num; idx++ ) {
+        const char* name = zip_get_name(sync.ar, idx, 0);
+        size_t      len;
+
+        /* Deleted entries have no name. */
+        if ( NULL == name ) continue;
+
+        len = strlen(name);
+        if ( len <= prefix_len || '/' == name[len-1] ) continue;
+        if ( 0 != strncmp(name, sync.prefix, prefix_len) ) continue;
+
+        push_int64(L, idx+1);
+        lua_setfield(L, sync.entries_idx, name);
+    }
+
+    lua_createtable(L, 0, 4);
+    sync.summary_idx = lua_gettop(L);
+    lua_newtable(L);
+    lua_setfield(L, -2, "added");
+    lua_newtable(L);
+    lua_setfield(L, -2, "replaced");
+    lua_newtable(L);
+    lua_setfield(L, -2, "deleted");
+
+    if ( 0 != S_sync_dir_walk(L, &sync, root, "") ) lua_error(L);
+
+    /* Anything not seen on disk has vanished. */
+    lua_pushnil(L);
+    while ( lua_next(L, sync.entries_idx) != 0 ) {
+        if ( lua_isnumber(L, -1) ) {
+            idx = (zip_int64_t)lua_tonumber(L, -1) - 1;
+            if ( 0 != zip_delete(sync.ar, idx) ) {
+                lua_pushfstring(L, "%s '%s'", zip_strerror(sync.ar), lua_tostring(L, -2));
+                lua_error(L);
+            }
+            lua_pushvalue(L, -2);
+            S_sync_append(L, &sync, "deleted");
+        }
+        lua_pop(L, 1);
+    }
+
+    push_int64(L, sync.unchanged);
+    lua_setfield(L, sync.summary_idx, "unchanged");
+
+    lua_pushvalue(L, sync.summary_idx);
+    return 1;
+}
+
+#else
+
+static int S_archive_sync_dir(lua_State* L) {
+    return luaL_error(L, "sync_dir is not supported on this platform");
+}
+
+#endif /* HAVE_SYNC_DIR */
+
+/* Open path (or path_idx if path is NULL) within the archive at
+ * ar_idx and push a new zip{archive.file} for it.  The archive keeps
+ * a weak reference so the file is invalidated when the archive is
+ * closed.  On failure, nil plus an error message is pushed and NULL
+ * is returned.
+ */
+static struct zip_file** S_archive_file_push(lua_State* L, int ar_idx, const char* path, zip_int64_t path_idx, int flags) {
+    struct zip*       ar   = *(struct zip**)lua_touserdata(L, ar_idx);
+    struct zip_file** file;
+
+    ar_idx = absindex(L, ar_idx);
+    file   = (struct zip_file**)lua_newuserdata(L, sizeof(struct zip_file*));
+    *file  = NULL;
+
     if ( NULL == path ) {
-        *file = zip_fopen_index(*ar, path_idx, flags);
+        *file = zip_fopen_index(ar, path_idx, flags);
     } else {
-        *file = zip_fopen(*ar, path, flags);
+        *file = zip_fopen(ar, path, flags);
     }
 
     if ( ! *file ) {
+        lua_pop(L, 1);
         lua_pushnil(L);
-        lua_pushstring(L, zip_strerror(*ar));
-        return 2;
+        lua_pushstring(L, zip_strerror(ar));
+        return NULL;
     }
 
     luaL_getmetatable(L, ARCHIVE_FILE_MT);
@@ -638,8 +1377,632 @@ static int S_archive_file_open(lua_State* L) {
 
     lua_setmetatable(L, -2);
 
-    S_archive_add_ref(L, 1, 1, -1);
+    S_archive_add_ref(L, 1, ar_idx, -1);
+
+    return file;
+}
+
+static int S_archive_file_open(lua_State* L) {
+    struct zip** ar        = check_archive(L, 1);
+    const char*  path      = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
+    zip_int64_t  path_idx  = (lua_isnumber(L, 2)) ? check_int64(L, 2)-1 : -1;
+    int          flags     = (lua_gettop(L) < 3)  ? 0    : luaL_checkint(L, 3);
+
+    if ( ! *ar ) return 0;
+
+    if ( NULL == S_archive_file_push(L, 1, path, path_idx, flags) ) return 2;
+
+    return 1;
+}
+
+/* Push a new zip{buffer} that can hold size bytes.
+ */
+static struct S_buffer* S_buffer_push(lua_State* L, size_t size) {
+    struct S_buffer* buffer = (struct S_buffer*)
+        lua_newuserdata(L, offsetof(struct S_buffer, data) + size);
+
+    buffer->len  = 0;
+    buffer->size = size;
+
+    luaL_getmetatable(L, BUFFER_MT);
+    assert(!lua_isnil(L, -1)/* BUFFER_MT found? */);
+
+    lua_setmetatable(L, -2);
+
+    return buffer;
+}
+
+static int S_buffer_tostring(lua_State* L) {
+    struct S_buffer* buffer = check_buffer(L, 1);
+
+    lua_pushlstring(L, buffer->data, buffer->len);
+    return 1;
+}
+
+static int S_buffer_len(lua_State* L) {
+    struct S_buffer* buffer = check_buffer(L, 1);
 
+    lua_pushinteger(L, buffer->len);
+    return 1;
+}
+
+/* Copy an entry to a sink in chunks, reusing one native buffer:
+ *
+ *     total, complete = ar:pipe(file, sink [, chunk_size | options])
+ *
+ * Stops early if the sink returns false.
+ */
+static int S_archive_pipe(lua_State* L) {
+    struct zip**      ar         = check_archive(L, 1);
+    const char*       path       = (lua_isnumber(L, 2)) ? NULL : luaL_checkstring(L, 2);
+    zip_int64_t       path_idx   = (lua_isnumber(L, 2)) ? check_int64(L, 2)-1 : -1;
+    zip_int64_t       chunk      = PIPE_CHUNK_SIZE;
+    int               flags      = 0;
+    int               use_buffer = 0;
+    int               complete   = 1;
+    zip_uint64_t      total      = 0;
+    struct S_buffer*  buffer     = NULL;
+    char*             buff;
+    struct zip_file** file;
+    int               buff_idx;
+    int               has_self   = 0;
+    zip_int64_t       len;
+
+    if ( lua_istable(L, 4) ) {
+        lua_getfield(L, 4, "chunk_size");
+        if ( ! lua_isnil(L, -1) ) chunk = check_int64(L, -1);
+        lua_getfield(L, 4, "flags");
+        if ( ! lua_isnil(L, -1) ) flags = luaL_checkint(L, -1);
+        lua_getfield(L, 4, "buffer");
+        use_buffer = lua_toboolean(L, -1);
+        lua_pop(L, 3);
+    } else if ( ! lua_isnoneornil(L, 4) ) {
+        chunk = check_int64(L, 4);
+    }
+    if ( chunk <= 0 ) luaL_argerror(L, 4, "chunk_size must be > 0");
+
+    /* Resolve the sink into a function at index 3 and an optional
+     * self argument at index 4.
+     */
+    lua_settop(L, 3);
+    if ( ! lua_isfunction(L, 3) ) {
+        if ( LUA_TTABLE != lua_type(L, 3) && LUA_TUSERDATA != lua_type(L, 3) ) {
+            luaL_argerror(L, 3, "function or object with a write method expected");
+        }
+        lua_getfield(L, 3, "write");
+        if ( ! lua_isfunction(L, -1) ) {
+            luaL_argerror(L, 3, "function or object with a write method expected");
+        }
+        lua_insert(L, 3);
+        has_self = 1;
+    }
+
+    if ( ! *ar ) return 0;
+
+    file = S_archive_file_push(L, 1, path, path_idx, flags);
+    if ( NULL == file ) return 2;
+
+    if ( use_buffer ) {
+        buffer   = S_buffer_push(L, chunk);
+        buff     = buffer->data;
+    } else {
+        buff     = (char*)lua_newuserdata(L, chunk);
+    }
+    buff_idx = lua_gettop(L);
+
+    while ( complete ) {
+        /* The sink may have closed the archive. */
+        if ( ! *file ) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "Archive was closed while piping");
+            return 2;
+        }
+
+        len = zip_fread(*file, buff, chunk);
+
+        if ( -1 == len ) {
+            lua_pushnil(L);
+            lua_pushstring(L, zip_file_strerror(*file));
+            zip_fclose(*file);
+            *file = NULL;
+            return 2;
+        }
+        if ( 0 == len ) break;
+
+        total += len;
+
+        lua_pushvalue(L, 3);
+        if ( has_self ) lua_pushvalue(L, 4);
+        if ( buffer ) {
+            buffer->len = len;
+            lua_pushvalue(L, buff_idx);
+        } else {
+            lua_pushlstring(L, buff, len);
+        }
+        lua_call(L, 1 + has_self, 1);
+
+        if ( lua_isboolean(L, -1) && ! lua_toboolean(L, -1) ) complete = 0;
+        lua_pop(L, 1);
+    }
+
+    if ( *file ) {
+        zip_fclose(*file);
+        *file = NULL;
+    }
+
+    push_int64(L, total);
+    lua_pushboolean(L, complete);
+    return 2;
+}
+
+/* Location of an entry's local header and data within the archive
+ * file, as read from the central directory.
+ */
+struct S_extent {
+    zip_uint64_t offset;
+    zip_uint64_t length;
+    zip_uint64_t comp_size;
+    zip_uint32_t crc;
+};
+
+/* Little endian integer of n bytes at p.
+ */
+static zip_uint64_t S_get_le(const unsigned char* p, int n) {
+    zip_uint64_t val = 0;
+
+    while ( n-- ) val = (val << 8) | p[n];
+
+    return val;
+}
+
+/* Read the extents of the num entries of the central directory of
+ * the archive at path, which libzip indexes in the same order.
+ * libzip does not expose local header offsets, hence the parsing.
+ * Returns 0 on success, or -1 if the central directory could not be
+ * read or does not have num entries.
+ */
+static zip_int64_t S_read_extents(const char* path, struct S_extent* extents, zip_uint64_t num) {
+    /* Big enough for the end of central directory record with the
+     * largest comment plus the Zip64 locator, or the name, extra
+     * field and comment of a central directory entry.
+     */
+    const size_t   buff_len = 3*65535 + 20 + 22;
+    unsigned char  hdr[56];
+    unsigned char* buff;
+    unsigned char* eocd;
+    FILE*          fh;
+    zip_int64_t    size, tail, i;
+    zip_uint64_t   count, cd_offset, n;
+
+    fh = fopen(path, "rb");
+    if ( NULL == fh ) return -1;
+
+    buff = (unsigned char*)malloc(buff_len);
+    if ( NULL == buff ) goto fail;
+
+    if ( 0 != fseeko(fh, 0, SEEK_END) ) goto fail;
+    size = ftello(fh);
+    tail = size < 65535 + 20 + 22 ? size : 65535 + 20 + 22;
+    if ( tail < 22 ) goto fail;
+    if ( 0 != fseeko(fh, size - tail, SEEK_SET) ) goto fail;
+    if ( fread(buff, 1, tail, fh) != (size_t)tail ) goto fail;
+
+    for ( i = tail - 22; i >= 0; i-- ) {
+        if ( 0x06054b50 == S_get_le(buff + i, 4) ) break;
+    }
+    if ( i < 0 ) goto fail;
+    eocd = buff + i;
+
+    count     = S_get_le(eocd + 10, 2);
+    cd_offset = S_get_le(eocd + 16, 4);
+
+    if ( 0xFFFF == count || 0xFFFFFFFF == cd_offset ) {
+        /* Zip64: the locator precedes the end of central directory */
+        if ( i < 20 || 0x07064b50 != S_get_le(eocd - 20, 4) ) goto fail;
+        if ( 0 != fseeko(fh, S_get_le(eocd - 20 + 8, 8), SEEK_SET) ) goto fail;
+        if ( fread(hdr, 1, 56, fh) != 56 ) goto fail;
+        if ( 0x06064b50 != S_get_le(hdr, 4) ) goto fail;
+        count     = S_get_le(hdr + 32, 8);
+        cd_offset = S_get_le(hdr + 48, 8);
+    }
+
+    if ( count != num ) goto fail;
+
+    if ( 0 != fseeko(fh, cd_offset, SEEK_SET) ) goto fail;
+
+    for ( n = 0; n < num; n++ ) {
+        zip_uint64_t   comp_size, uncomp_size, offset, name_len, extra_len, rest;
+        unsigned char* extra;
+        unsigned char* end;
+
+        if ( fread(hdr, 1, 46, fh) != 46 ) goto fail;
+        if ( 0x02014b50 != S_get_le(hdr, 4) ) goto fail;
+
+        comp_size   = S_get_le(hdr + 20, 4);
+        uncomp_size = S_get_le(hdr + 24, 4);
+        name_len    = S_get_le(hdr + 28, 2);
+        extra_len   = S_get_le(hdr + 30, 2);
+        rest        = name_len + extra_len + S_get_le(hdr + 32, 2);
+        offset      = S_get_le(hdr + 42, 4);
+
+        if ( fread(buff, 1, rest, fh) != rest ) goto fail;
+
+        /* Zip64 extended information holds the fields that
+         * overflowed, in this order.
+         */
+        extra = buff + name_len;
+        end   = extra + extra_len;
+        while ( extra + 4 <= end ) {
+            zip_uint64_t   id  = S_get_le(extra, 2);
+            unsigned char* val = extra + 4;
+            extra = val + S_get_le(extra + 2, 2);
+            if ( 0x0001 != id || extra > end ) continue;
+            if ( 0xFFFFFFFF == uncomp_size && val + 8 <= extra ) {
+                uncomp_size = S_get_le(val, 8);
+                val += 8;
+            }
+            if ( 0xFFFFFFFF == comp_size && val + 8 <= extra ) {
+                comp_size = S_get_le(val, 8);
+                val += 8;
+            }
+            if ( 0xFFFFFFFF == offset && val + 8 <= extra ) {
+                offset = S_get_le(val, 8);
+            }
+            break;
+        }
+
+        /* The local extra field may differ from the central one,
+         * so this is only an estimate (used for readahead hints).
+         */
+        extents[n].offset    = offset;
+        extents[n].length    = 30 + name_len + extra_len + comp_size;
+        extents[n].comp_size = comp_size;
+        extents[n].crc       = (zip_uint32_t)S_get_le(hdr + 16, 4);
+    }
+
+    free(buff);
+    fclose(fh);
+    return 0;
+
+fail:
+    free(buff);
+    fclose(fh);
+    return -1;
+}
+
+/* Return the extents of the num original entries of the archive at
+ * ar_idx, or NULL if they are not available.  The central directory
+ * is read on first use and cached in the archive's metatable, so the
+ * cost of a read_batch() call does not grow with the archive.
+ */
+static struct S_extent* S_get_extents(lua_State* L, int ar_idx, zip_int64_t num) {
+    struct S_extent* extents = NULL;
+    const char*      path;
+    int              ok = lua_getmetatable(L, ar_idx);
+
+    assert(ok /* ar_idx has metatable */);
+
+    /* false if the extents could not be read or are stale. */
+    lua_getfield(L, -1, "extents");
+    if ( ! lua_isnil(L, -1) ) {
+        extents = (struct S_extent*)lua_touserdata(L, -1);
+        lua_pop(L, 2);
+        return extents;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, "path");
+    path = lua_tostring(L, -1);
+    if ( NULL != path ) {
+        extents = (struct S_extent*)
+            lua_newuserdata(L, (num ? num : 1) * sizeof(struct S_extent));
+        if ( 0 != S_read_extents(path, extents, num) ) {
+            lua_pop(L, 1);
+            extents = NULL;
+        }
+    }
+    if ( NULL == extents ) lua_pushboolean(L, 0);
+    lua_setfield(L, -3, "extents");
+    lua_pop(L, 2);
+
+    return extents;
+}
+
+/* Stop using the cached extents of the archive at ar_idx, because
+ * they do not describe the file libzip has open.
+ */
+static void S_set_extents_stale(lua_State* L, int ar_idx) {
+    int ok = lua_getmetatable(L, ar_idx);
+
+    assert(ok /* ar_idx has metatable */);
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "extents");
+    lua_pop(L, 1);
+}
+
+/* Returns true if the data of the entry at idx has not been changed
+ * since the archive was opened, so it is still at its original
+ * location on disk.
+ */
+static int S_is_unchanged(struct zip* ar, zip_uint64_t idx) {
+    struct zip_stat cur, orig;
+
+    if ( 0 != zip_stat_index(ar, idx, 0, &cur) ) return 0;
+    if ( 0 != zip_stat_index(ar, idx, ZIP_FL_UNCHANGED, &orig) ) return 0;
+
+    return cur.valid     == orig.valid     &&
+           cur.size      == orig.size      &&
+           cur.comp_size == orig.comp_size &&
+           cur.crc       == orig.crc       &&
+           cur.mtime     == orig.mtime;
+}
+
+static void S_fd_close(int* fd) {
+    if ( *fd < 0 ) return;
+
+#ifdef HAVE_READAHEAD
+    close(*fd);
+#endif
+    *fd = -1;
+}
+
+static int S_fd_gc(lua_State* L) {
+    S_fd_close((int*)luaL_checkudata(L, 1, FD_MT));
+    return 0;
+}
+
+struct S_batch_item {
+    zip_uint64_t idx;
+    zip_uint64_t offset;
+    zip_uint64_t length;
+    lua_Integer  pos;
+};
+
+static int S_batch_item_cmp(const void* a, const void* b) {
+    const struct S_batch_item* x = (const struct S_batch_item*)a;
+    const struct S_batch_item* y = (const struct S_batch_item*)b;
+
+    if ( x->offset != y->offset ) return x->offset < y->offset ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* Read the entire contents of a list of entries, in order of their
+ * location within the archive file:
+ *
+ *     results = ar:read_batch(list [, options])
+ *
+ * Entries that changed since the archive was opened are read last.
+ */
+static int S_archive_read_batch(lua_State* L) {
+    struct zip**         ar        = check_archive(L, 1);
+    int                  by_offset = 1;
+    int                  flags     = 0;
+    int*                 fd;
+    zip_int64_t          readahead = READ_BATCH_READAHEAD;
+    zip_uint64_t         buff_len  = 0;
+    zip_int64_t          num_entries;
+    char*                buff      = NULL;
+    struct S_batch_item* items;
+    lua_Integer          num, pos;
+    int                  callback_idx = 0, result_idx, buff_idx;
+#ifdef HAVE_READAHEAD
+    zip_uint64_t         ahead     = 0;
+    lua_Integer          advised   = 0;
+#endif
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if ( ! lua_isnoneornil(L, 3) ) {
+        static const char* orders[] = { "offset", "list", NULL };
+
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_settop(L, 3);
+
+        lua_getfield(L, 3, "order");
+        if ( ! lua_isnil(L, -1) ) by_offset = 0 == luaL_checkoption(L, -1, NULL, orders);
+        lua_getfield(L, 3, "flags");
+        if ( ! lua_isnil(L, -1) ) flags = luaL_checkint(L, -1);
+        lua_getfield(L, 3, "readahead");
+        if ( ! lua_isnil(L, -1) ) readahead = check_int64(L, -1);
+        lua_pop(L, 3);
+
+        lua_getfield(L, 3, "callback");
+        if ( lua_isnil(L, -1) ) {
+            lua_pop(L, 1);
+        } else {
+            luaL_checktype(L, -1, LUA_TFUNCTION);
+            callback_idx = lua_gettop(L);
+        }
+    }
+
+    if ( ! *ar ) return 0;
+
+    num_entries = zip_get_num_entries(*ar, 0);
+
+    num   = lua_objlen(L, 2);
+    items = (struct S_batch_item*)
+        lua_newuserdata(L, (num ? num : 1) * sizeof(struct S_batch_item));
+
+    for ( pos = 1; pos <= num; pos++ ) {
+        struct S_batch_item* item = &items[pos-1];
+        zip_int64_t          idx;
+
+        lua_rawgeti(L, 2, pos);
+        if ( lua_type(L, -1) == LUA_TNUMBER ) {
+            lua_Number n = lua_tonumber(L, -1);
+            if ( ! ( n >= 1 && n <= (lua_Number)num_entries ) ) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "Invalid file index '%s'", lua_tostring(L, -2));
+                return 2;
+            }
+            idx = (zip_int64_t)n - 1;
+        } else if ( lua_type(L, -1) == LUA_TSTRING ) {
+            idx = zip_name_locate(*ar, lua_tostring(L, -1), flags);
+            if ( idx < 0 ) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "%s '%s'", zip_strerror(*ar), lua_tostring(L, -2));
+                return 2;
+            }
+        } else {
+            return luaL_argerror(L, 2, "list of filenames or file indices expected");
+        }
+        lua_pop(L, 1);
+
+        item->idx    = idx;
+        item->offset = (zip_uint64_t)-1;
+        item->length = 0;
+        item->pos    = pos;
+    }
+
+    if ( by_offset && num > 1 ) {
+        zip_int64_t      num_orig = zip_get_num_entries(*ar, ZIP_FL_UNCHANGED);
+        struct S_extent* extents  = S_get_extents(L, 1, num_orig);
+        int              stale    = NULL == extents;
+
+        for ( pos = 0; pos < num && ! stale; pos++ ) {
+            struct S_batch_item* item = &items[pos];
+            struct S_extent*     extent;
+            struct zip_stat      orig;
+
+            if ( (zip_int64_t)item->idx >= num_orig ) continue;
+            if ( ! S_is_unchanged(*ar, item->idx) ) continue;
+
+            /* If the file at path was replaced since it was opened,
+             * its central directory describes some other archive.
+             */
+            extent = &extents[item->idx];
+            if ( 0 != zip_stat_index(*ar, item->idx, ZIP_FL_UNCHANGED, &orig) ||
+                 orig.comp_size != extent->comp_size ||
+                 orig.crc       != extent->crc )
+            {
+                stale = 1;
+                break;
+            }
+
+            item->offset = extent->offset;
+            item->length = extent->length;
+        }
+
+        if ( stale ) {
+            S_set_extents_stale(L, 1);
+            for ( pos = 0; pos < num; pos++ ) {
+                items[pos].offset = (zip_uint64_t)-1;
+                items[pos].length = 0;
+            }
+        } else {
+            qsort(items, num, sizeof(struct S_batch_item), &S_batch_item_cmp);
+        }
+    }
+
+    /* The descriptor lives in a userdata so it is closed even if the
+     * callback (or a memory error) unwinds past us.
+     */
+    fd  = (int*)lua_newuserdata(L, sizeof(int));
+    *fd = -1;
+    luaL_getmetatable(L, FD_MT);
+    lua_setmetatable(L, -2);
+
+#ifdef HAVE_READAHEAD
+    if ( readahead > 0 && by_offset ) {
+        const char* path;
+
+        S_get_path(L, 1);
+        path = lua_tostring(L, -1);
+        if ( NULL != path ) *fd = open(path, O_RDONLY);
+        lua_pop(L, 1);
+    }
+#else
+    (void)readahead;
+#endif
+
+    if ( callback_idx ) {
+        result_idx = 0;
+    } else {
+        lua_createtable(L, num, 0);
+        result_idx = lua_gettop(L);
+    }
+
+    lua_pushnil(L);
+    buff_idx = lua_gettop(L);
+
+    for ( pos = 0; pos < num; pos++ ) {
+        struct S_batch_item* item = &items[pos];
+        struct zip_stat      stat;
+        struct zip_file*     file;
+        zip_uint64_t         size, total = 0;
+        zip_int64_t          got = 0;
+
+        /* The callback may have closed the archive. */
+        if ( ! *ar ) {
+            S_fd_close(fd);
+            lua_pushnil(L);
+            lua_pushliteral(L, "Archive was closed while reading");
+            return 2;
+        }
+
+#ifdef HAVE_READAHEAD
+        /* Keep the kernel reading ahead of us. */
+        while ( *fd >= 0 && advised < num && (advised <= pos || ahead < (zip_uint64_t)readahead) ) {
+            struct S_batch_item* next = &items[advised++];
+            if ( 0 == next->length ) continue;
+            posix_fadvise(*fd, next->offset, next->length, POSIX_FADV_WILLNEED);
+            ahead += next->length;
+        }
+        if ( *fd >= 0 ) ahead -= item->length;
+#endif
+
+        if ( 0 != zip_stat_index(*ar, item->idx, flags, &stat) ) {
+            S_fd_close(fd);
+            lua_pushnil(L);
+            lua_pushstring(L, zip_strerror(*ar));
+            return 2;
+        }
+        size = (flags & ZIP_FL_COMPRESSED) ? stat.comp_size : stat.size;
+
+        if ( size > buff_len ) {
+            buff     = (char*)lua_newuserdata(L, size);
+            buff_len = size;
+            lua_replace(L, buff_idx);
+        }
+
+        file = zip_fopen_index(*ar, item->idx, flags);
+        if ( NULL == file ) {
+            S_fd_close(fd);
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s '%s'", zip_strerror(*ar), stat.name);
+            return 2;
+        }
+        while ( total < size ) {
+            got = zip_fread(file, buff + total, size - total);
+            if ( got <= 0 ) break;
+            total += got;
+        }
+        if ( got < 0 ) {
+            S_fd_close(fd);
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s '%s'", zip_file_strerror(file), stat.name);
+            zip_fclose(file);
+            return 2;
+        }
+        zip_fclose(file);
+
+        if ( callback_idx ) {
+            lua_pushvalue(L, callback_idx);
+            lua_pushinteger(L, item->pos);
+            lua_pushlstring(L, total ? buff : "", total);
+            lua_call(L, 2, 0);
+        } else {
+            lua_pushlstring(L, total ? buff : "", total);
+            lua_rawseti(L, result_idx, item->pos);
+        }
+    }
+
+    S_fd_close(fd);
+
+    if ( callback_idx ) {
+        lua_pushinteger(L, num);
+    } else {
+        lua_pushvalue(L, result_idx);
+    }
     return 1;
 }
 
@@ -673,7 +2036,7 @@ static int S_archive_file_gc(lua_State* L) {
 
 static int S_archive_file_read(lua_State* L) {
     struct zip_file** file = check_archive_file(L, 1);
-    int               len  = luaL_checkint(L, 2);
+    zip_int64_t       len  = check_int64(L, 2);
     char*             buff;
 
     if ( len <= 0 ) luaL_argerror(L, 2, "Must be > 0");
@@ -694,6 +2057,106 @@ static int S_archive_file_read(lua_State* L) {
     return 1;
 }
 
+/* C ABI used by the LuaJIT FFI fast path (see zip_ffi.lua).
+ *
+ * Every function takes the payload of an existing zip{archive},
+ * zip{archive.file} or zip{buffer} userdata (LuaJIT passes a
+ * userdata to a void* parameter as a pointer to its payload), so the
+ * lifetime of the underlying libzip objects is still governed by the
+ * Lua objects.
+ * Once an archive is closed or collected the payload is NULL and
+ * every call fails.  Indices are zero based, just like libzip.
+ *
+ * Keep the declarations below in sync with the ffi.cdef in
+ * zip_ffi.lua and the exports in lua_zip.def.
+ */
+typedef struct lua_zip_stat {
+    zip_uint64_t index;
+    zip_uint64_t size;
+    zip_uint64_t comp_size;
+    zip_int64_t  mtime;
+    zip_uint32_t crc;
+    zip_uint16_t comp_method;
+    zip_uint16_t encryption_method;
+} lua_zip_stat;
+
+LUALIB_API zip_int64_t lua_zip_name_locate(void* ud, const char* fname, int flags) {
+    struct zip* ar = *(struct zip**)ud;
+
+    if ( ! ar ) return -1;
+
+    return zip_name_locate(ar, fname, flags);
+}
+
+LUALIB_API int lua_zip_stat_index(void* ud, zip_uint64_t idx, int flags, lua_zip_stat* sb) {
+    struct zip*     ar = *(struct zip**)ud;
+    struct zip_stat stat;
+
+    if ( ! ar ) return -1;
+
+    if ( 0 != zip_stat_index(ar, idx, flags, &stat) ) return -1;
+
+    sb->index             = stat.index;
+    sb->size              = stat.size;
+    sb->comp_size         = stat.comp_size;
+    sb->mtime             = stat.mtime;
+    sb->crc               = stat.crc;
+    sb->comp_method       = stat.comp_method;
+    sb->encryption_method = stat.encryption_method;
+
+    return 0;
+}
+
+LUALIB_API const char* lua_zip_strerror(void* ud) {
+    struct zip* ar = *(struct zip**)ud;
+
+    if ( ! ar ) return "Archive is closed";
+
+    return zip_strerror(ar);
+}
+
+/* Read at most len bytes into the caller owned buf.  Returns the
+ * number of bytes read, 0 at end of file, or -1 on error.
+ */
+LUALIB_API zip_int64_t lua_zip_file_read(void* ud, void* buf, zip_uint64_t len) {
+    struct zip_file* file = *(struct zip_file**)ud;
+
+    if ( ! file ) return -1;
+
+    return zip_fread(file, buf, len);
+}
+
+LUALIB_API int lua_zip_file_close(void* ud) {
+    struct zip_file** file = (struct zip_file**)ud;
+    int               err;
+
+    if ( ! *file ) return 0;
+
+    err = zip_fclose(*file);
+    *file = NULL;
+
+    return err;
+}
+
+LUALIB_API const char* lua_zip_file_strerror(void* ud) {
+    struct zip_file* file = *(struct zip_file**)ud;
+
+    if ( ! file ) return "File is closed";
+
+    return zip_file_strerror(file);
+}
+
+/* Returns the data of a zip{buffer} handed to an ar:pipe() sink and
+ * stores the number of valid bytes in len.
+ */
+LUALIB_API const void* lua_zip_buffer_data(void* ud, size_t* len) {
+    struct S_buffer* buffer = (struct S_buffer*)ud;
+
+    *len = buffer->len;
+
+    return buffer->data;
+}
+
 static void S_register_archive(lua_State* L) {
     luaL_newmetatable(L, ARCHIVE_MT);
 
@@ -709,6 +2172,12 @@ static void S_register_archive(lua_State* L) {
     lua_pushcfunction(L, S_archive_file_open);
     lua_setfield(L, -2, "open");
 
+    lua_pushcfunction(L, S_archive_pipe);
+    lua_setfield(L, -2, "pipe");
+
+    lua_pushcfunction(L, S_archive_read_batch);
+    lua_setfield(L, -2, "read_batch");
+
     lua_pushcfunction(L, S_archive_stat);
     lua_setfield(L, -2, "stat");
 
@@ -736,6 +2205,9 @@ static void S_register_archive(lua_State* L) {
     lua_pushcfunction(L, S_archive_add);
     lua_setfield(L, -2, "add");
 
+    lua_pushcfunction(L, S_archive_add_many);
+    lua_setfield(L, -2, "add_many");
+
     lua_pushcfunction(L, S_archive_replace);
     lua_setfield(L, -2, "replace");
 
@@ -745,6 +2217,9 @@ static void S_register_archive(lua_State* L) {
     lua_pushcfunction(L, S_archive_delete);
     lua_setfield(L, -2, "delete");
 
+    lua_pushcfunction(L, S_archive_sync_dir);
+    lua_setfield(L, -2, "sync_dir");
+
     lua_pop(L, 1);
 }
 
@@ -766,6 +2241,41 @@ static void S_register_archive_file(lua_State* L) {
     lua_pop(L, 1);
 }
 
+static void S_register_buffer(lua_State* L) {
+    luaL_newmetatable(L, BUFFER_MT);
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, S_buffer_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pushcfunction(L, S_buffer_tostring);
+    lua_setfield(L, -2, "tostring");
+
+    lua_pop(L, 1);
+}
+
+#ifdef HAVE_SYNC_DIR
+static void S_register_dir(lua_State* L) {
+    luaL_newmetatable(L, DIR_MT);
+
+    lua_pushcfunction(L, S_dir_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pop(L, 1);
+}
+#endif
+
+static void S_register_fd(lua_State* L) {
+    luaL_newmetatable(L, FD_MT);
+
+    lua_pushcfunction(L, S_fd_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pop(L, 1);
+}
+
 static void S_register_weak(lua_State* L) {
     luaL_newmetatable(L, WEAK_MT);
 
@@ -813,6 +2323,11 @@ LUALIB_API int luaopen_brimworks_zip(lua_State* L) {
 
     S_register_archive(L);
     S_register_archive_file(L);
+    S_register_buffer(L);
+#ifdef HAVE_SYNC_DIR
+    S_register_dir(L);
+#endif
+    S_register_fd(L);
     S_register_weak(L);
 
     return 1;
@@ -16,6 +16,7 @@ function load_libs(build_dir)
     if ( f ) then
         f:close()
         package.cpath = build_dir .. "/?.so;" .. package.cpath
+        package.path  = build_dir .. "/?.lua;" .. package.path
     end
 
     package.path = _0:gsub("(.*/)(.*)", "%1?.lua;") .. package.path
@@ -55,6 +56,479 @@ function main()
     test_delete()
     test_zip_source()
     test_file_source()
+    test_ffi_read()
+    test_pipe()
+    test_zip64()
+    test_sync_dir()
+    test_close_progress()
+    test_read_batch()
+    test_add_many()
+end
+
+function test_add_many()
+    local test_add_many = tmp_dir .. "test_add_many.zip"
+
+    os.remove(test_add_many)
+    local ar = assert(zip.open(test_add_many,
+                                zip.OR(zip.CREATE, zip.EXCL)));
+
+    local entries = {}
+    for i=1, 100 do
+        entries[i] = { "dir/file" .. i, "string", "Contents " .. i }
+    end
+    entries[101] = { "source.txt", "file", _0, 2, 12 }
+    local first, last = ar:add_many(entries)
+    ok(first == 1 and last == 101, "add_many returns first and last index")
+
+    -- The source data is copied, so the strings may be collected:
+    entries = nil
+    collectgarbage("collect")
+
+    local err = select(2, pcall(ar.add_many, ar, {
+        { "ok.txt", "string", "ok" },
+        { "zip.txt", "zip", ar, 1 },
+    }))
+    ok(string.match(err, "entry 2: invalid source type"),
+       "add_many rejects zip sources, err=" .. tostring(err))
+
+    err = select(2, pcall(ar.add_many, ar, { { 1, "string", 2 } }))
+    ok(string.match(err, "entry 1: filename expected"),
+       "add_many rejects a non-string filename, err=" .. tostring(err))
+
+    err = select(2, pcall(ar.add_many, ar, {
+        { "ok.txt", "file", _0, "two" },
+    }))
+    ok(string.match(err, "entry 1: start must be"),
+       "add_many rejects a non-numeric start, err=" .. tostring(err))
+
+    -- Entries added before a failing one are removed again:
+    err = select(2, pcall(ar.add_many, ar, {
+        { "new.txt", "string", "new" },
+        { "dir/file1", "string", "dup" },
+    }))
+    ok(string.match(err, "entry 2: File already exists"),
+       "add_many duplicate error=" .. tostring(err))
+    ok(nil == ar:name_locate("new.txt"), "add_many rolls back on error")
+
+    ar:close()
+
+    ar = assert(zip.open(test_add_many, zip.CHECKCONS))
+    ok(101 == #ar, "Archive contains 101 entries: " .. #ar)
+    local results = assert(ar:read_batch({ "dir/file1", "dir/file100", "source.txt" }))
+    is_deeply(results, { "Contents 1", "Contents 100", "/usr/bin/env" },
+              "add_many contents")
+    ar:close()
+end
+
+function test_read_batch()
+    local test_read_batch = tmp_dir .. "test_read_batch.zip"
+
+    os.remove(test_read_batch)
+    local ar = assert(zip.open(test_read_batch,
+                                zip.OR(zip.CREATE, zip.EXCL)));
+    for i=1, 20 do
+        ar:add("file" .. i, "string", string.rep(tostring(i), i))
+    end
+    ar:close()
+
+    ar = assert(zip.open(test_read_batch))
+
+    -- Reverse order, mixing names and indices:
+    local list = {}
+    for i=20, 1, -1 do
+        list[#list+1] = (i % 2 == 0) and ("file" .. i) or i
+    end
+    local results = assert(ar:read_batch(list))
+    local all_ok = #results == 20
+    for pos, i in ipairs({ 20, 19, 18, 17, 16, 15, 14, 13, 12, 11,
+                           10, 9, 8, 7, 6, 5, 4, 3, 2, 1 }) do
+        all_ok = all_ok and results[pos] == string.rep(tostring(i), i)
+    end
+    ok(all_ok, "read_batch returns results in list order")
+
+    -- The callback is invoked in disk order:
+    local positions = {}
+    local count = ar:read_batch(list, {
+        order = "offset",
+        callback = function(pos, data)
+            positions[#positions+1] = pos
+            assert(data == results[pos])
+        end,
+    })
+    ok(count == 20 and positions[1] == 20 and positions[20] == 1,
+       "read_batch callback in disk order")
+
+    positions = {}
+    ar:read_batch(list, {
+        order = "list",
+        callback = function(pos) positions[#positions+1] = pos end,
+    })
+    ok(positions[1] == 1 and positions[20] == 20,
+       "read_batch callback in list order")
+
+    -- Changed entries are read from their new source:
+    ar:replace(1, "string", "changed")
+    results = assert(ar:read_batch({ "file1", "file2" }))
+    ok(results[1] == "changed" and results[2] == "22",
+       "read_batch reads changed entries")
+
+    local err = select(2, ar:read_batch({ "file1", "DNE" }))
+    ok(string.match(err, "No such file"), "read_batch missing file error=" .. tostring(err))
+
+    for _, idx in ipairs({ 0, 21, 2^60+1, 1e9 }) do
+        err = select(2, ar:read_batch({ 1, idx }))
+        ok(string.match(tostring(err), "Invalid file index"),
+           "read_batch invalid index " .. idx .. " error=" .. tostring(err))
+    end
+
+    ar:close()
+
+    -- If the file is replaced on disk, its central directory no
+    -- longer matches and entries are read in list order:
+    local other = tmp_dir .. "test_read_batch_other.zip"
+    os.remove(other)
+    ar = assert(zip.open(other, zip.OR(zip.CREATE, zip.EXCL)))
+    for i=1, 20 do
+        ar:add("file" .. i, "string", "other" .. i)
+    end
+    ar:close()
+
+    -- ...unless it was already read (and cached) before:
+    local cached = assert(zip.open(test_read_batch))
+    assert(cached:read_batch(list))
+
+    ar = assert(zip.open(test_read_batch))
+    assert(os.rename(other, test_read_batch))
+
+    positions = {}
+    cached:read_batch(list, {
+        callback = function(pos) positions[#positions+1] = pos end,
+    })
+    ok(positions[1] == 20 and positions[20] == 1,
+       "read_batch caches the central directory")
+    cached:close()
+
+    positions = {}
+    results = {}
+    ar:read_batch(list, {
+        callback = function(pos, data)
+            positions[#positions+1] = pos
+            results[pos] = data
+        end,
+    })
+    ok(positions[1] == 1 and positions[20] == 20 and
+       results[1] == string.rep("20", 20),
+       "read_batch ignores a replaced central directory")
+    ar:close()
+end
+
+function test_close_progress()
+    local test_close = tmp_dir .. "test_close_progress.zip"
+    local data       = string.rep("x", 100000)
+
+    os.remove(test_close)
+    local ar = assert(zip.open(test_close, zip.OR(zip.CREATE, zip.EXCL)))
+    ar:add("first.txt", "string", "First")
+    local isok, err = pcall(ar.close, ar, {})
+    if ( not isok and string.match(err, "libzip 1.6") ) then
+        ar:close()
+        ok(true, "# SKIP test_close_progress requires libzip 1.6")
+        return
+    end
+    ok(isok, "close with empty options, err=" .. tostring(err))
+
+    -- Progress reporting:
+    ar = assert(zip.open(test_close))
+    for i=1, 10 do
+        ar:add("file" .. i, "string", data)
+    end
+    local calls = {}
+    ar:close({
+        interval = 0.01,
+        progress = function(fraction, bytes, elapsed)
+            calls[#calls+1] = { fraction, bytes, elapsed }
+        end,
+    })
+    local last = calls[#calls]
+    ok(#calls > 1, "progress called " .. #calls .. " times")
+    ok(last and last[1] > 0.9 and last[1] <= 1,
+       "progress ends near 1.0: " .. tostring(last and last[1]))
+    ok(last and (last[1] < 1 or last[2] == 10*#data + 5),
+       "progress reports all bytes at 1.0: " .. tostring(last and last[2]))
+    local sorted = true
+    for i=2, #calls do
+        if ( calls[i][1] < calls[i-1][1] or calls[i][2] < calls[i-1][2] or
+             calls[i][3] < calls[i-1][3] ) then
+            sorted = false
+        end
+    end
+    ok(sorted, "progress is monotonic")
+
+    -- Cancelling leaves the archive unchanged and no temporary files:
+    ar = assert(zip.open(test_close))
+    ar:add("cancelled.txt", "string", data)
+    isok, err = pcall(ar.close, ar, {
+        cancel = function(fraction) return true end,
+    })
+    ok(not isok and string.match(err, "cancel"), "cancelled close error=" .. tostring(err))
+
+    ar = assert(zip.open(test_close, zip.CHECKCONS))
+    ok(11 == #ar, "cancelled close left archive unchanged: " .. #ar)
+    ar:close()
+
+    local ls = io.popen("ls " .. tmp_dir)
+    local leftover = false
+    for name in ls:lines() do
+        if ( string.match(name, "^test_close_progress%.zip.") ) then
+            leftover = true
+        end
+    end
+    ls:close()
+    ok(not leftover, "cancelled close removed its temporary file")
+
+    -- Errors raised by a callback cancel the close and are re-raised:
+    ar = assert(zip.open(test_close))
+    ar:delete("first.txt")
+    isok, err = pcall(ar.close, ar, {
+        progress = function() error("progress failed") end,
+    })
+    ok(not isok and string.match(err, "progress failed"),
+       "progress error is re-raised, err=" .. tostring(err))
+    ar = assert(zip.open(test_close, zip.CHECKCONS))
+    ok(11 == #ar, "failed close left archive unchanged: " .. #ar)
+    ar:close()
+end
+
+function test_sync_dir()
+    if ( package.config:sub(1, 1) == "\\" ) then
+        ok(true, "# SKIP test_sync_dir is not supported on Windows")
+        return
+    end
+    local test_sync_dir = tmp_dir .. "test_sync_dir.zip"
+    local tree          = tmp_dir .. "sync_tree"
+    local function write(path, data)
+        local f = assert(io.open(tree .. "/" .. path, "wb"))
+        f:write(data)
+        f:close()
+    end
+    local function read(ar, name)
+        local file = assert(ar:open(name))
+        local str = file:read(256)
+        file:close()
+        return str
+    end
+
+    os.execute("rm -rf " .. tree)
+    os.execute("mkdir -p " .. tree .. "/a/b")
+    write("one.txt", "1")
+    write("a/two.txt", "2")
+    write("a/b/three.txt", "3")
+
+    os.remove(test_sync_dir)
+    local ar = assert(zip.open(test_sync_dir,
+                                zip.OR(zip.CREATE, zip.EXCL)));
+    ar:add("other.txt", "string", "Other")
+
+    local summary = ar:sync_dir(tree, { prefix = "tree/" })
+    ok(#summary.added == 3 and summary.unchanged == 0,
+       "sync_dir adds new files, added=" .. #summary.added)
+    ar:close()
+
+    ar = assert(zip.open(test_sync_dir, zip.CHECKCONS))
+    summary = ar:sync_dir(tree, { prefix = "tree/" })
+    ok(summary.unchanged == 3 and #summary.added == 0 and
+       #summary.replaced == 0 and #summary.deleted == 0,
+       "sync_dir leaves unchanged files alone, unchanged=" .. summary.unchanged)
+
+    write("a/two.txt", "22")
+    os.remove(tree .. "/one.txt")
+    write("four.txt", "4")
+
+    summary = ar:sync_dir(tree, { prefix = "tree/" })
+    is_deeply(summary, {
+        added     = { "tree/four.txt" },
+        replaced  = { "tree/a/two.txt" },
+        deleted   = { "tree/one.txt" },
+        unchanged = 1,
+    }, "sync_dir summary")
+    ar:close()
+
+    ar = assert(zip.open(test_sync_dir, zip.CHECKCONS))
+    ok(4 == #ar, "Archive contains four entries: " .. #ar)
+    ok(read(ar, "tree/a/two.txt") == "22", "sync_dir replaced contents")
+    ok(read(ar, "other.txt") == "Other", "sync_dir ignores entries outside prefix")
+
+    -- Same size and mtime, so only a crc comparison notices:
+    local ref = tmp_dir .. "sync_tree_ref"
+    os.execute("touch -r " .. tree .. "/a/b/three.txt " .. ref)
+    write("a/b/three.txt", "X")
+    os.execute("touch -r " .. ref .. " " .. tree .. "/a/b/three.txt")
+
+    summary = ar:sync_dir(tree, { prefix = "tree/" })
+    ok(#summary.replaced == 0, "sync_dir without crc trusts size and mtime")
+    summary = ar:sync_dir(tree, { prefix = "tree/", crc = true })
+    ok(#summary.replaced == 1 and summary.replaced[1] == "tree/a/b/three.txt",
+       "sync_dir with crc notices changed contents")
+    ar:close()
+
+    ar = assert(zip.open(test_sync_dir, zip.CHECKCONS))
+    ok(read(ar, "tree/a/b/three.txt") == "X", "sync_dir crc replaced contents")
+    ar:close()
+
+    -- Symlinks to files are followed, symlinks to directories are not:
+    os.execute("ln -s .. " .. tree .. "/a/b/loop")
+    os.execute("ln -s ../one.txt " .. tree .. "/a/dangling")
+    os.execute("ln -s two.txt " .. tree .. "/a/link.txt")
+    ar = assert(zip.open(test_sync_dir))
+    summary = ar:sync_dir(tree, { prefix = "tree/" })
+    is_deeply(summary.added, { "tree/a/link.txt" },
+              "sync_dir skips directory and dangling symlinks")
+    ar:close()
+
+    local err = select(2, pcall(ar.sync_dir, assert(zip.open(test_sync_dir)),
+                                tree .. "/DNE"))
+    ok(string.match(err, "No such file"), "sync_dir missing root error=" .. tostring(err))
+end
+
+-- Zip64 stress test.  This needs several GB of disk and a few minutes
+-- so it only runs if LUA_ZIP_STRESS is set in the environment.
+function test_zip64()
+    if ( not os.getenv("LUA_ZIP_STRESS") ) then
+        ok(true, "# SKIP test_zip64 requires LUA_ZIP_STRESS=1")
+        return
+    end
+
+    local GB           = 1024 * 1024 * 1024
+    local sparse_file  = tmp_dir .. "test_zip64.bin"
+    local test_zip64   = tmp_dir .. "test_zip64.zip"
+    local num_entries  = 1000000
+
+    -- A sparse 7 GB file with a marker at the end:
+    os.remove(sparse_file)
+    local f = assert(io.open(sparse_file, "wb"))
+    assert(f:seek("set", 7*GB - 3))
+    assert(f:write("END"))
+    f:close()
+
+    os.remove(test_zip64)
+    local ar = assert(zip.open(test_zip64, zip.OR(zip.CREATE, zip.EXCL)))
+
+    -- A member larger than 4 GB starting past 2^31 in the file:
+    local start = 2*GB + 5
+    local big_idx = ar:add("big.bin", "file", sparse_file, start)
+
+    -- A member that ends exactly at the marker, past the 4 GB mark:
+    ar:add("end.bin", "file", sparse_file, 7*GB - 3, 3)
+
+    -- More entries than fit in a 16 bit count:
+    for i=1, num_entries do
+        ar:add("e/" .. i, "string", "")
+    end
+    ar:close()
+
+    ar = assert(zip.open(test_zip64, zip.CHECKCONS))
+    ok(#ar == num_entries + 2, "zip64 entry count=" .. tostring(#ar))
+
+    local sb = assert(ar:stat("big.bin"))
+    ok(sb.size == 7*GB - start, "zip64 big member size=" .. tostring(sb.size))
+    ok(sb.index == big_idx, "zip64 big member index")
+
+    local last = "e/" .. num_entries
+    ok(ar:name_locate(last) == num_entries + 2,
+       "zip64 locate index > 65535")
+    ok(ar:get_name(num_entries + 2) == last, "zip64 get_name index > 65535")
+
+    local file = assert(ar:open("end.bin"))
+    ok(file:read(16) == "END", "zip64 read member past 4 GB")
+    file:close()
+
+    ar:close()
+    os.remove(sparse_file)
+    os.remove(test_zip64)
+end
+
+function test_pipe()
+    local ar = assert(zip.open(test_zip_file))
+
+    -- Function sink with a tiny chunk size:
+    local chunks = {}
+    local total, complete = ar:pipe("test/text.txt", function(chunk)
+        chunks[#chunks+1] = chunk
+    end, 4)
+    ok(total == 14 and complete, "pipe total=" .. tostring(total))
+    ok(#chunks == 4, "pipe chunk count=" .. #chunks)
+    ok(table.concat(chunks) == "one\ntwo\nthree\n", "pipe contents")
+
+    -- Object sink, stopping early:
+    local sink = { data = "" }
+    function sink:write(chunk)
+        self.data = self.data .. chunk
+        return #self.data < 8
+    end
+    total, complete = ar:pipe(2, sink, 4)
+    ok(total == 8 and not complete, "pipe stops when sink returns false")
+    ok(sink.data == "one\ntwo\n", "pipe object sink=" .. sink.data)
+
+    -- Reused buffer object:
+    local buffers = {}
+    chunks = {}
+    total = ar:pipe(2, function(buf)
+        buffers[buf] = true
+        chunks[#chunks+1] = buf:tostring()
+        ok(#buf == #chunks[#chunks], "#buf is the chunk length")
+    end, { chunk_size = 8, buffer = true })
+    ok(table.concat(chunks) == "one\ntwo\nthree\n", "pipe buffer contents")
+    local count = 0
+    for _ in pairs(buffers) do count = count + 1 end
+    ok(count == 1, "pipe reuses one buffer")
+
+    local err = select(2, ar:pipe("DNE", function() end))
+    ok(string.match(err, "No such file"), "pipe missing file error=" .. tostring(err))
+
+    -- Closing the archive from within the sink:
+    total, err = ar:pipe(2, function() ar:close() end, 4)
+    ok(nil == total and err, "pipe after close error=" .. tostring(err))
+end
+
+function test_ffi_read()
+    local zip_ffi = require("brimworks.zip_ffi")
+    if ( not zip_ffi.available ) then
+        ok(true, "# SKIP test_ffi_read requires LuaJIT")
+        return
+    end
+    local ffi = require("ffi")
+
+    local ar = assert(zip.open(test_zip_file))
+
+    ok(2 == zip_ffi.name_locate(ar, "test/text.txt"),
+       "ffi name_locate")
+
+    local sb = assert(zip_ffi.stat(ar, "test/text.txt"))
+    ok(14 == tonumber(sb.size) and 635884982 == sb.crc, "ffi stat")
+
+    local buf, len = assert(zip_ffi.read_all(ar, 2))
+    ok(ffi.string(buf, len) == "one\ntwo\nthree\n", "ffi read_all")
+
+    local file = assert(ar:open(2))
+    buf = zip_ffi.buffer(4)
+    local got = zip_ffi.read(file, buf)
+    ok(got == 4 and ffi.string(buf, got) == "one\n", "ffi read")
+    ok(not pcall(zip_ffi.read, file, buf, 5), "ffi read len > buf")
+    ok(not pcall(zip_ffi.read, file, buf + 0), "ffi read ptr without len")
+    got = zip_ffi.read(file, buf + 0, 4)
+    ok(got == 4 and ffi.string(buf, got) == "two\n", "ffi read ptr")
+    ok(zip_ffi.close(file), "ffi close")
+
+    sb = assert(zip_ffi.stat(ar, 2))
+    buf, len = assert(zip_ffi.read_all(ar, 2, zip.FL_COMPRESSED))
+    ok(len == tonumber(sb.comp_size), "ffi read_all compressed")
+
+    -- Closing the archive invalidates handles used by the fast path:
+    file = assert(ar:open(2))
+    ar:close()
+    ok(nil == zip_ffi.read(file, buf), "ffi read after archive close")
+    ok(nil == zip_ffi.name_locate(ar, "test/text.txt"),
+       "ffi name_locate after archive close")
 end
 
 function test_file_source()
@@ -148,7 +622,8 @@ function test_replace()
                                 zip.OR(zip.CREATE, zip.EXCL)));
 
     local idx = ar:add("dir/test.txt", "string", "Contents")
-    ar:replace(idx, "string", "Replacement")
+    ok(idx == ar:replace(idx, "string", "Replacement"),
+       "replace returns the file index")
 
     ar:close()
 
@@ -0,0 +1,191 @@
+-- LuaJIT FFI fast path for brimworks.zip.
+--
+-- Reads archive entries straight into caller owned uint8_t[]
+-- buffers without creating intermediate Lua strings.  Archives and
+-- file handles are still opened with the classic API, so their
+-- lifetimes (and invalidation on zip_arc:close()) work as usual.
+--
+-- When not running under LuaJIT, zip_ffi.available is false and the
+-- remaining functions are not defined.
+
+local zip = require("brimworks.zip")
+
+local M = { available = false }
+
+if ( type(jit) ~= "table" ) then return M end
+
+local has_ffi, ffi = pcall(require, "ffi")
+if ( not has_ffi ) then return M end
+local bit = require("bit")
+
+-- Keep in sync with the C ABI in lua_zip.c:
+ffi.cdef[[
+typedef struct lua_zip_stat {
+    uint64_t index;
+    uint64_t size;
+    uint64_t comp_size;
+    int64_t  mtime;
+    uint32_t crc;
+    uint16_t comp_method;
+    uint16_t encryption_method;
+} lua_zip_stat;
+
+int64_t     lua_zip_name_locate(void* ar, const char* fname, int flags);
+int         lua_zip_stat_index(void* ar, uint64_t idx, int flags, lua_zip_stat* sb);
+const char* lua_zip_strerror(void* ar);
+int64_t     lua_zip_file_read(void* file, void* buf, uint64_t len);
+int         lua_zip_file_close(void* file);
+const char* lua_zip_file_strerror(void* file);
+const void* lua_zip_buffer_data(void* buffer, size_t* len);
+]]
+
+-- The C module is loaded with RTLD_LOCAL, so bind it explicitly:
+local lib_path = package.searchpath("brimworks.zip", package.cpath)
+if ( not lib_path ) then return M end
+local lib = ffi.load(lib_path)
+
+local registry   = debug.getregistry()
+local ARCHIVE_MT = registry["zip{archive}"]
+local FILE_MT    = registry["zip{archive.file}"]
+local BUFFER_MT  = registry["zip{buffer}"]
+
+local stat_t   = ffi.typeof("lua_zip_stat")
+local buffer_t = ffi.typeof("uint8_t[?]")
+local size_t   = ffi.typeof("size_t[1]")
+local data_t   = ffi.typeof("const uint8_t*")
+
+-- The FFI can not validate userdata, so do the same checks as
+-- check_archive() and check_archive_file() in lua_zip.c:
+local function check_archive(ar)
+    local mt = type(ar) == "userdata" and getmetatable(ar)
+    if ( not mt or mt.__index ~= ARCHIVE_MT ) then
+        error("zip{archive} expected, got " .. type(ar), 3)
+    end
+end
+
+local function check_file(file)
+    if ( type(file) ~= "userdata" or getmetatable(file) ~= FILE_MT ) then
+        error("zip{archive.file} expected, got " .. type(file), 3)
+    end
+end
+
+M.available = true
+
+-- Allocate a buffer suitable for zip_ffi.read().
+function M.buffer(len)
+    return buffer_t(len)
+end
+
+-- Returns the 1 based index of fname, or nil plus an error message.
+function M.name_locate(ar, fname, flags)
+    check_archive(ar)
+    local idx = lib.lua_zip_name_locate(ar, fname, flags or 0)
+    if ( idx < 0 ) then
+        return nil, ffi.string(lib.lua_zip_strerror(ar))
+    end
+    return tonumber(idx) + 1
+end
+
+-- Fills in (or allocates) a lua_zip_stat struct for the specified
+-- filename or 1 based file index.  Returns nil plus an error message
+-- on failure.
+function M.stat(ar, file, flags, sb)
+    check_archive(ar)
+    flags = flags or 0
+    local idx = file
+    if ( type(file) ~= "number" ) then
+        idx = lib.lua_zip_name_locate(ar, file, flags)
+        if ( idx < 0 ) then
+            return nil, ffi.string(lib.lua_zip_strerror(ar))
+        end
+    else
+        idx = idx - 1
+    end
+    sb = sb or stat_t()
+    if ( 0 ~= lib.lua_zip_stat_index(ar, idx, flags, sb) ) then
+        return nil, ffi.string(lib.lua_zip_strerror(ar))
+    end
+    return sb
+end
+
+-- Read at most len bytes from a file opened by zip_arc:open() into
+-- buf.  If buf came from zip_ffi.buffer(), len defaults to (and may
+-- not exceed) its size.  For any other cdata, len is required.
+-- Returns the number of bytes read (0 at end of file), or nil plus an
+-- error message.
+function M.read(file, buf, len)
+    check_file(file)
+    if ( ffi.istype(buffer_t, buf) ) then
+        local size = ffi.sizeof(buf)
+        if ( len == nil ) then
+            len = size
+        elseif ( len > size ) then
+            error("len (" .. len .. ") exceeds the size of buf (" ..
+                  size .. ")", 2)
+        end
+    elseif ( len == nil ) then
+        error("len is required unless buf is a zip_ffi.buffer()", 2)
+    end
+    if ( len < 0 ) then
+        error("len must be a non-negative number", 2)
+    end
+    local got = lib.lua_zip_file_read(file, buf, len)
+    if ( got < 0 ) then
+        return nil, ffi.string(lib.lua_zip_file_strerror(file))
+    end
+    return tonumber(got)
+end
+
+-- Read the entire contents of the specified filename or file index.
+-- With zip.FL_COMPRESSED the raw compressed stream is returned.
+-- Returns a uint8_t[] buffer and its length, or nil plus an error
+-- message.
+function M.read_all(ar, file, flags)
+    flags = flags or 0
+    local sb, err = M.stat(ar, file, flags)
+    if ( not sb ) then return nil, err end
+
+    local size = tonumber(bit.band(flags, zip.FL_COMPRESSED) ~= 0
+                          and sb.comp_size or sb.size)
+    local fh
+    fh, err = ar:open(tonumber(sb.index) + 1, flags)
+    if ( not fh ) then return nil, err end
+
+    local buf = buffer_t(size)
+    local off = 0
+    while ( off < size ) do
+        local got = lib.lua_zip_file_read(fh, buf + off, size - off)
+        if ( got <= 0 ) then
+            err = got < 0 and ffi.string(lib.lua_zip_file_strerror(fh))
+                or "Unexpected end of file"
+            lib.lua_zip_file_close(fh)
+            return nil, err
+        end
+        off = off + tonumber(got)
+    end
+    lib.lua_zip_file_close(fh)
+    return buf, size
+end
+
+-- Returns a pointer to the data of a zip{buffer} passed to an
+-- zip_arc:pipe() sink along with the number of valid bytes.  The
+-- pointer is only valid until the sink returns.
+function M.buffer_data(buffer)
+    if ( type(buffer) ~= "userdata" or getmetatable(buffer) ~= BUFFER_MT ) then
+        error("zip{buffer} expected, got " .. type(buffer), 2)
+    end
+    local len = size_t()
+    local ptr = ffi.cast(data_t, lib.lua_zip_buffer_data(buffer, len))
+    return ptr, tonumber(len[0])
+end
+
+-- Same as file:close(), but does not throw an error.  Returns true
+-- on success, otherwise nil plus a libzip error code.
+function M.close(file)
+    check_file(file)
+    local err = lib.lua_zip_file_close(file)
+    if ( err ~= 0 ) then return nil, err end
+    return true
+end
+
+return M